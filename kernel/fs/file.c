@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <mm.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <task.h>
+#include <vfs.h>
+#include <file.h>
+#include <uaccess.h>
+
+// File descriptors. Every address space has its own table, made on its
+// first open(), so programs only see their own files; kernel tasks share
+// one. Descriptors 0-2 are kept free for stdin/stdout/stderr.
+
+#define FD_FIRST 3
+
+static struct fd_table kernel_fds = { .lock = SPINLOCK_INIT };
+
+// The running task's table. NULL if it has none yet and create is false,
+// or there's no memory for one.
+static struct fd_table *current_fds(bool create) {
+    struct vm_space *space = current_task->space;
+    if (space == NULL) return &kernel_fds;
+
+    struct fd_table *fds = __atomic_load_n(&space->fds, __ATOMIC_ACQUIRE);
+    if (fds || !create) return fds;
+    fds = malloc(sizeof(struct fd_table));
+    if (fds == NULL) return NULL;
+    memset(fds, 0, sizeof(struct fd_table));
+    spin_lock_init(&fds->lock);
+
+    // Someone else may have beaten us to it
+    struct fd_table *expected = NULL;
+    if (!__atomic_compare_exchange_n(&space->fds, &expected, fds, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(fds);
+        return expected;
+    }
+    return fds;
+}
+
+// Lock the running task's table and find fd in it. NULL (and nothing
+// locked) if it isn't open.
+static struct file *fd_lock(uint64_t fd, struct fd_table **table, uint64_t *flags) {
+    struct fd_table *fds = current_fds(false);
+    if (fds == NULL || fd >= MAX_FDS) return NULL;
+
+    *flags = spin_lock_irqsave(&fds->lock);
+    if (!fds->files[fd].used) {
+        spin_unlock_irqrestore(&fds->lock, *flags);
+        return NULL;
+    }
+    *table = fds;
+    return &fds->files[fd];
+}
+
+// What fd refers to. Nodes are never freed, so it stays valid after a close.
+struct vfs_node *fd_node(uint64_t fd) {
+    struct fd_table *fds;
+    uint64_t flags;
+    struct file *f = fd_lock(fd, &fds, &flags);
+    if (f == NULL) return NULL;
+    struct vfs_node *node = f->node;
+    spin_unlock_irqrestore(&fds->lock, flags);
+    return node;
+}
+
+int64_t sys_open(const char *path, uint64_t flags) {
+    char name[VFS_PATH_MAX];
+    int64_t len = strncpy_from_user(name, path, sizeof(name));
+    if (len < 0) return len;
+
+    // The rootfs is the only thing mounted and it can't be written to
+    if ((flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+
+    struct vfs_node *node = vfs_lookup(name);
+    if (node == NULL) return -ENOENT;
+
+    struct fd_table *fds = current_fds(true);
+    if (fds == NULL) return -ENOMEM;
+
+    uint64_t irq = spin_lock_irqsave(&fds->lock);
+    int64_t ret = -EMFILE;
+    for (int fd = FD_FIRST; fd < MAX_FDS; fd++) {
+        struct file *f = &fds->files[fd];
+        if (f->used) continue;
+        f->used = true;
+        f->node = node;
+        f->offset = 0;
+        f->flags = flags;
+        ret = fd;
+        break;
+    }
+    spin_unlock_irqrestore(&fds->lock, irq);
+    return ret;
+}
+
+// vfs_read() into a program's buffer. Resident files are copied straight
+// from where they sit, anything else goes through a bounce buffer.
+static int64_t read_user(struct vfs_node *node, void *buf, uint64_t offset, uint64_t len) {
+    if (!access_ok(buf, len)) return -EFAULT;
+    if (node->type == VFS_DIR) return -EISDIR;
+    if (offset >= node->size || len == 0) return 0;
+    if (len > node->size - offset) len = node->size - offset;
+
+    uint8_t *data = vfs_data(node);
+    if (data) return copy_to_user(buf, data + offset, len) < 0 ? -EFAULT : (int64_t)len;
+
+    uint64_t chunk = len < PAGE_SIZE ? len : PAGE_SIZE;
+    uint8_t *bounce = malloc(chunk);
+    if (bounce == NULL) return -ENOMEM;
+    uint64_t done = 0;
+    int64_t err = 0;
+    while (done < len) {
+        uint64_t want = len - done < chunk ? len - done : chunk;
+        int64_t n = vfs_read(node, bounce, offset + done, want);
+        if (n <= 0) {
+            err = n;
+            break;
+        }
+        if (copy_to_user((uint8_t *)buf + done, bounce, n) < 0) {
+            err = -EFAULT;
+            break;
+        }
+        done += n;
+        if ((uint64_t)n < want) break;
+    }
+    free(bounce);
+    return done ? (int64_t)done : err;
+}
+
+int64_t sys_pread(uint64_t fd, void *buf, uint64_t len, uint64_t offset) {
+    struct vfs_node *node = fd_node(fd);
+    if (node == NULL) return -EBADF;
+    return read_user(node, buf, offset, len);
+}
+
+int64_t sys_read(uint64_t fd, void *buf, uint64_t len) {
+    // 1. Where to read from. The lock isn't held while reading, the
+    //    buffer may have to be faulted in.
+    struct fd_table *fds;
+    uint64_t flags;
+    struct file *f = fd_lock(fd, &fds, &flags);
+    if (f == NULL) return -EBADF;
+    struct vfs_node *node = f->node;
+    uint64_t offset = f->offset;
+    spin_unlock_irqrestore(&fds->lock, flags);
+
+    int64_t n = read_user(node, buf, offset, len);
+
+    // 2. Move the offset on, if fd still refers to the same file
+    if (n > 0) {
+        flags = spin_lock_irqsave(&fds->lock);
+        if (f->used && f->node == node) f->offset = offset + n;
+        spin_unlock_irqrestore(&fds->lock, flags);
+    }
+    return n;
+}
+
+int64_t sys_lseek(uint64_t fd, int64_t offset, uint64_t whence) {
+    struct fd_table *fds;
+    uint64_t flags;
+    struct file *f = fd_lock(fd, &fds, &flags);
+    if (f == NULL) return -EBADF;
+
+    int64_t base = -1;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (int64_t)f->offset; break;
+        case SEEK_END: base = (int64_t)f->node->size; break;
+    }
+
+    // Seeking past the end is fine, reads there just return 0
+    int64_t ret = -EINVAL;
+    if (base >= 0 && base + offset >= 0) {
+        f->offset = (uint64_t)(base + offset);
+        ret = (int64_t)f->offset;
+    }
+    spin_unlock_irqrestore(&fds->lock, flags);
+    return ret;
+}
+
+int64_t sys_close(uint64_t fd) {
+    struct fd_table *fds;
+    uint64_t flags;
+    struct file *f = fd_lock(fd, &fds, &flags);
+    if (f == NULL) return -EBADF;
+    f->used = false;
+    f->node = NULL;
+    spin_unlock_irqrestore(&fds->lock, flags);
+    return 0;
+}
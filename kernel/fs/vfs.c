@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <panic.h>
+#include <errno.h>
+#include <mm.h>
+#include <pmm.h>
+#include <vfs.h>
+
+// An in-memory VFS: every file and directory is a vfs_node in one tree.
+// Resolving a path walks the tree a component at a time, and every step is
+// a lookup in the dentry cache keyed by (parent, name), so nothing ever has
+// to rescan the backing archive.
+
+#define VFS_ARENA_CHUNK (64 * 1024)
+
+static struct vfs_node root_node;
+static uint64_t next_ino = 1;
+
+// Dentry cache: chained hash table, doubled when it gets as full as it is wide
+static struct vfs_node **dcache = NULL;
+static uint32_t dcache_mask = 0;
+static uint32_t dcache_count = 0;
+
+// Nodes and names live as long as the tree does, so carve them out of big
+// chunks instead of going to the heap once per file.
+static uint8_t *arena_ptr = NULL;
+static size_t arena_left = 0;
+
+static void *vfs_alloc(size_t size) {
+    size = (size + 7) & ~7;
+    if (size > arena_left) {
+        size_t chunk = size > VFS_ARENA_CHUNK ? size : VFS_ARENA_CHUNK;
+        arena_ptr = malloc(chunk);
+        if (arena_ptr == NULL) {
+            arena_left = 0;
+            return NULL;
+        }
+        arena_left = chunk;
+    }
+    void *ptr = arena_ptr;
+    arena_ptr += size;
+    arena_left -= size;
+    return ptr;
+}
+
+// FNV-1a over the parent pointer and the name
+static uint32_t dentry_hash(struct vfs_node *parent, const char *name, uint32_t len) {
+    uint64_t p = (uint64_t)parent;
+    uint32_t hash = (2166136261u ^ (uint32_t)(p ^ (p >> 32))) * 16777619u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void dcache_grow(void) {
+    uint32_t size = dcache ? (dcache_mask + 1) * 2 : 256;
+    struct vfs_node **table = malloc(size * sizeof(struct vfs_node *));
+    if (table == NULL) return; // Not fatal, chains just get longer
+    memset(table, 0, size * sizeof(struct vfs_node *));
+
+    if (dcache) {
+        for (uint32_t i = 0; i <= dcache_mask; i++) {
+            struct vfs_node *node = dcache[i];
+            while (node) {
+                struct vfs_node *next = node->hash_next;
+                node->hash_next = table[node->hash & (size - 1)];
+                table[node->hash & (size - 1)] = node;
+                node = next;
+            }
+        }
+        free(dcache);
+    }
+    dcache = table;
+    dcache_mask = size - 1;
+}
+
+static struct vfs_node *dcache_lookup(struct vfs_node *parent, const char *name, uint32_t len) {
+    uint32_t hash = dentry_hash(parent, name, len);
+    for (struct vfs_node *node = dcache[hash & dcache_mask]; node; node = node->hash_next) {
+        if (node->hash == hash && node->parent == parent &&
+            node->name_len == len && memcmp(node->name, name, len) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static struct vfs_node *new_node(struct vfs_node *parent, const char *name, uint32_t len, int type, struct vfs_fs *fs) {
+    struct vfs_node *node = vfs_alloc(sizeof(struct vfs_node) + len + 1);
+    if (node == NULL) return NULL;
+    memset(node, 0, sizeof(struct vfs_node));
+
+    // 1. The name is stored right behind the node
+    char *copy = (char *)(node + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    node->name = copy;
+    node->name_len = len;
+
+    node->type = type;
+    node->mode = (type == VFS_DIR) ? 0755 : 0644;
+    node->ino = next_ino++;
+    node->fs = fs;
+
+    // 2. Link it into the parent, keeping creation order for readdir
+    node->parent = parent;
+    if (parent->last_child) parent->last_child->next = node;
+    else parent->children = node;
+    parent->last_child = node;
+
+    // 3. And into the dentry cache
+    if (dcache_count > dcache_mask) dcache_grow();
+    node->hash = dentry_hash(parent, name, len);
+    node->hash_next = dcache[node->hash & dcache_mask];
+    dcache[node->hash & dcache_mask] = node;
+    dcache_count++;
+
+    return node;
+}
+
+// Resolve path from base (or the root if it's absolute). With create set,
+// missing components are made: directories, except the last which is `type`.
+static struct vfs_node *vfs_walk(struct vfs_node *base, const char *path, bool create, int type, struct vfs_fs *fs) {
+    struct vfs_node *node = (base == NULL || path[0] == '/') ? &root_node : base;
+
+    while (*path) {
+        // 1. Grab the next component
+        while (*path == '/') path++;
+        const char *comp = path;
+        while (*path && *path != '/') path++;
+        uint32_t len = path - comp;
+
+        // 2. "." and empty components stay put, ".." goes up (the root is its own parent)
+        if (len == 0 || (len == 1 && comp[0] == '.')) continue;
+        if (node->type != VFS_DIR) return NULL;
+        if (len == 2 && comp[0] == '.' && comp[1] == '.') {
+            if (node->parent) node = node->parent;
+            continue;
+        }
+        if (len >= VFS_NAME_MAX) return NULL;
+
+        // 3. One hash lookup per component
+        struct vfs_node *child = dcache_lookup(node, comp, len);
+        if (child == NULL) {
+            if (!create) return NULL;
+
+            const char *rest = path;
+            while (*rest == '/') rest++;
+            child = new_node(node, comp, len, *rest ? VFS_DIR : type, fs);
+            if (child == NULL) return NULL;
+        }
+        node = child;
+    }
+    return node;
+}
+
+void init_vfs(void) {
+    root_node.name = "";
+    root_node.type = VFS_DIR;
+    root_node.mode = 0755;
+    root_node.ino = next_ino++;
+    dcache_grow();
+    if (dcache == NULL) panic("Not enough memory for the VFS.");
+}
+
+struct vfs_node *vfs_root(void) {
+    return &root_node;
+}
+
+int vfs_mount(const char *path, struct vfs_fs *fs, void *source) {
+    struct vfs_node *mountpoint = vfs_lookup(path);
+    if (mountpoint == NULL) return -ENOENT;
+    if (mountpoint->type != VFS_DIR) return -ENOTDIR;
+
+    mountpoint->fs = fs;
+    return fs->mount ? fs->mount(mountpoint, source) : 0;
+}
+
+struct vfs_node *vfs_create(struct vfs_node *base, const char *path, int type, struct vfs_fs *fs) {
+    return vfs_walk(base, path, true, type, fs);
+}
+
+struct vfs_node *vfs_lookup(const char *path) {
+    return vfs_walk(NULL, path, false, 0, NULL);
+}
+
+struct vfs_node *vfs_lookup_at(struct vfs_node *base, const char *path) {
+    return vfs_walk(base, path, false, 0, NULL);
+}
+
+void vfs_stat_node(struct vfs_node *node, struct vfs_stat *st) {
+    st->ino = node->ino;
+    st->type = node->type;
+    st->mode = node->mode;
+    st->size = node->size;
+    st->mtime = node->mtime;
+}
+
+int vfs_stat(const char *path, struct vfs_stat *st) {
+    struct vfs_node *node = vfs_lookup(path);
+    if (node == NULL) return -ENOENT;
+    vfs_stat_node(node, st);
+    return 0;
+}
+
+// Iterate a directory: pass NULL for the first entry, then the previous one.
+// Returns NULL at the end.
+struct vfs_node *vfs_readdir(struct vfs_node *dir, struct vfs_node *prev) {
+    if (dir->type != VFS_DIR) return NULL;
+    return prev ? prev->next : dir->children;
+}
+
+int64_t vfs_read(struct vfs_node *node, void *buf, uint64_t offset, uint64_t len) {
+    if (node->type == VFS_DIR) return -EISDIR;
+    if (node->fs == NULL || node->fs->read == NULL) return -ENOSYS;
+
+    // Clamp to the end of the file
+    if (offset >= node->size) return 0;
+    if (len > node->size - offset) len = node->size - offset;
+
+    return node->fs->read(node, buf, offset, len);
+}
+
+// Where the file's bytes live, if they are resident. NULL otherwise.
+void *vfs_data(struct vfs_node *node) {
+    if (node->type != VFS_FILE || node->fs == NULL || node->fs->data == NULL) return NULL;
+    return node->fs->data(node);
+}
+
+// The file's bytes starting on a page boundary, for mapping them into an
+// address space as they are. A resident file that already starts on one is
+// used in place; anything else is copied once into pages of its own, kept
+// for next time. NULL if that fails. Pages past the end of the file may
+// hold whatever follows it.
+void *vfs_pages(struct vfs_node *node) {
+    if (node->type != VFS_FILE) return NULL;
+    void *cached = __atomic_load_n(&node->pages, __ATOMIC_ACQUIRE);
+    if (cached) return cached;
+
+    uint8_t *data = vfs_data(node);
+    if (data && ((uint64_t)data & (PAGE_SIZE - 1)) == 0) {
+        node->pages = data;
+        return data;
+    }
+
+    // Whole pages of our own, so nothing else of the heap gets mapped with them
+    uint64_t size = (node->size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint8_t *raw = malloc(size + PAGE_SIZE);
+    if (raw == NULL) return NULL;
+    uint8_t *pages = (uint8_t *)(((uint64_t)raw + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    if (data) memcpy(pages, data, node->size);
+    else if (vfs_read(node, pages, 0, node->size) != (int64_t)node->size) {
+        free(raw);
+        return NULL;
+    }
+    memset(pages + node->size, 0, size - node->size);
+
+    // Someone else may have beaten us to it
+    void *expected = NULL;
+    if (!__atomic_compare_exchange_n(&node->pages, &expected, pages, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(raw);
+        return expected;
+    }
+    return pages;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC registers (offsets into the MMIO page)
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0
+#define LAPIC_ICR_LOW    0x300
+#define LAPIC_ICR_HIGH   0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE     (1 << 8)
+#define LAPIC_LVT_MASKED     (1 << 16)
+#define LAPIC_TIMER_ONESHOT  (0 << 17)
+#define LAPIC_TIMER_DEADLINE (2 << 17)
+#define LAPIC_ICR_PENDING    (1 << 12)
+
+bool lapic_present(void);
+void init_lapic(void);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+void lapic_eoi(void);
+uint32_t lapic_id(void);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
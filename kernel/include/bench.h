@@ -0,0 +1,7 @@
+#pragma once
+
+// Boot-time benchmarks, only built with 'make BENCH=1' (-DCONFIG_BENCH).
+// Each subsystem keeps its bench_*() next to the code it measures.
+#ifdef CONFIG_BENCH
+void run_benchmarks(void);
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+// clock_gettime() clocks
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+struct timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
+// TSC ticks per second, measured at boot
+extern uint64_t tsc_hz;
+
+void init_clock(void);
+bool clock_tsc_invariant(void);
+uint64_t ktime_ns(void);
+uint64_t tsc_to_ns(uint64_t cycles);
+int64_t sys_clock_gettime(uint64_t clock, struct timespec *ts);
+
+// Microseconds to TSC ticks, without overflowing for long delays
+static inline uint64_t tsc_from_us(uint64_t us) {
+    return (us / 1000000) * tsc_hz + (us % 1000000) * tsc_hz / 1000000;
+}
+
+#ifdef CONFIG_BENCH
+void bench_clock(void);
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Tick rate of the periodic PIT fallback
+#define HZ 100
+
+// Nothing to wake up for
+#define CLOCKEVENT_NONE UINT64_MAX
+
+void init_clockevent(void);
+void init_clockevent_ap(void);
+void clockevent_program(uint64_t deadline);
+bool clockevent_oneshot(void);
+void timer_interrupt(void);
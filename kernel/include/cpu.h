@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MSR_EFER  0xC0000080
+#define EFER_SCE  (1 << 0)  // SYSCALL/SYSRET enable
+#define EFER_NXE  (1 << 11) // No-execute enable
+
+#define CR0_MP (1 << 1)  // WAIT/FWAIT honour TS
+#define CR0_EM (1 << 2)  // Emulate the FPU, i.e. have none
+#define CR0_TS (1 << 3)  // Task switched: the next FPU/SSE instruction traps with #NM
+#define CR0_NE (1 << 5)  // Native x87 error reporting
+#define CR0_WP (1 << 16) // Read-only pages are read-only for the kernel too
+
+#define CR4_PGE        (1 << 7)  // Global pages
+#define CR4_OSFXSR     (1 << 9)  // FXSAVE/FXRSTOR and SSE
+#define CR4_OSXMMEXCPT (1 << 10) // SSE exceptions as #XM
+#define CR4_PCIDE      (1 << 17) // Process-context identifiers in CR3
+#define CR4_OSXSAVE    (1 << 18) // XSAVE and XCR0
+
+#define RFLAGS_TF (1 << 8)  // Single step
+#define RFLAGS_IF (1 << 9)  // Interrupts enabled
+#define RFLAGS_DF (1 << 10) // String instructions go down
+#define RFLAGS_AC (1 << 18) // Alignment checks in ring 3
+
+#define MSR_APIC_BASE      0x1B
+#define MSR_TSC_DEADLINE   0x6E0
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    asm volatile (
+        "wrmsr"
+        :
+        : "c"(msr), "a"(low), "d"(high)
+        : "memory"
+    );
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile (
+        "rdmsr"
+        : "=a"(low), "=d"(high)
+        : "c"(msr)
+        : "memory"
+    );
+    return ((uint64_t)high << 32) | low;
+}
+
+// Address of the last page fault
+static inline uint64_t read_cr2(void) {
+    uint64_t value;
+    asm volatile ("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    asm volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+    asm volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    asm volatile ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    asm volatile ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    asm volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    asm volatile ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline void invlpg(uint64_t addr) {
+    asm volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+#define INVPCID_ALL 3 // Every PCID's entries, except global pages
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct { uint64_t pcid, addr; } desc = { pcid, addr };
+    asm volatile ("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+// Index of the lowest set bit. Undefined for 0.
+static inline uint64_t bsf(uint64_t value) {
+    uint64_t index;
+    asm ("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// Index of the highest set bit. Undefined for 0.
+static inline uint64_t bsr(uint64_t value) {
+    uint64_t index;
+    asm ("bsr %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// Disable interrupts, returning the old RFLAGS for irq_restore
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    asm volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// Spin-wait hint, for busy loops on another CPU
+static inline void cpu_relax(void) {
+    asm volatile ("pause" : : : "memory");
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <vfs.h>
+
+// ELF64, just what loading a static executable needs
+#define ELF_MAGIC      0x464C457F // "\x7FELF"
+#define ELFCLASS64     2
+#define ELFDATA2LSB    1
+#define ET_EXEC        2
+#define EM_X86_64      62
+
+#define PT_LOAD 1
+
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
+struct elf64_ehdr {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t pad[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version2;
+    uint64_t entry;
+    uint64_t phoff;     // Program headers, from the start of the file
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+struct elf64_phdr {
+    uint32_t type;
+    uint32_t flags;     // PF_*
+    uint64_t offset;    // In the file
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;     // Past filesz is zero-filled (.bss)
+    uint64_t align;
+};
+
+// Programs' stacks sit at the top of the user half, above the mmap() area
+#define USER_STACK_TOP  (USER_END - PAGE_SIZE) // The last page stays unmapped
+#define USER_STACK_SIZE (64 * 1024)
+
+// What elf_load() found
+struct elf_image {
+    uint64_t entry;
+    uint64_t brk;           // First page past the highest segment
+};
+
+int elf_load(struct vfs_node *node, struct vm_space *space, struct elf_image *image);
+int64_t elf_spawn(const char *path);
+
+#ifdef CONFIG_BENCH
+void bench_elf(void);
+#endif
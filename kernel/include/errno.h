@@ -0,0 +1,23 @@
+#pragma once
+
+// Error numbers, returned negated (-ENOENT) by kernel calls and syscalls.
+#define EPERM         1
+#define ENOENT        2
+#define ESRCH         3
+#define EIO           5
+#define ENOEXEC       8
+#define EBADF         9
+#define ENOMEM       12
+#define EACCES       13
+#define EFAULT       14
+#define EEXIST       17
+#define ENODEV       19
+#define ENOTDIR      20
+#define EISDIR       21
+#define EINVAL       22
+#define EMFILE       24
+#define EROFS        30
+#define EDEADLK      35
+#define ENAMETOOLONG 36
+#define ENOSYS       38
+#define ETIMEDOUT    110
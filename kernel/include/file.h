@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <vfs.h>
+#include <spinlock.h>
+
+#define MAX_FDS 64
+
+// open() flags
+#define O_RDONLY  0
+#define O_WRONLY  1
+#define O_RDWR    2
+#define O_ACCMODE 3
+
+// lseek() whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+struct file {
+    bool used;
+    struct vfs_node *node;
+    uint64_t offset;
+    uint64_t flags;
+};
+
+// A program's open files, one table per address space (tasks without one
+// share the kernel's). lock covers the slots and their offsets.
+struct fd_table {
+    spinlock_t lock;
+    struct file files[MAX_FDS];
+};
+
+struct vfs_node *fd_node(uint64_t fd);
+
+int64_t sys_open(const char *path, uint64_t flags);
+int64_t sys_read(uint64_t fd, void *buf, uint64_t len);
+int64_t sys_pread(uint64_t fd, void *buf, uint64_t len, uint64_t offset);
+int64_t sys_lseek(uint64_t fd, int64_t offset, uint64_t whence);
+int64_t sys_close(uint64_t fd);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+struct tcb;
+
+// XCR0 bits: the state components XSAVE covers
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+// Default control words: all exceptions masked, round to nearest
+#define FPU_DEFAULT_FCW   0x037F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+// Without XSAVE the state is a FXSAVE area
+#define FXSAVE_SIZE 512
+
+void init_fpu(void);
+void init_fpu_ap(void);
+void fpu_switch(struct tcb *prev);
+void fpu_trap(void);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// Selectors. Kernel code and data stay where Limine had them, so nothing
+// that was set up before we load our own GDT has to change. Ring 3 follows
+// in the order SYSRET wants: 32-bit code (left empty, there's no compat
+// mode), data, then 64-bit code.
+#define GDT_KERNEL_CS 0x28
+#define GDT_KERNEL_DS 0x30
+#define GDT_USER_BASE 0x38       // SYSRET's base in STAR
+#define GDT_USER_DS   (0x40 | 3)
+#define GDT_USER_CS   (0x48 | 3)
+#define GDT_TSS       0x50
+#define GDT_ENTRIES   (GDT_TSS / 8 + 2) // The TSS descriptor takes two
+
+// Interrupt stacks (1-based, 0 means "current stack")
+#define IST_DOUBLE_FAULT 1
+#define IST_STACK_SIZE   4096
+
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];        // Stack for entering ring 0 from rings 1-3 (see __schedule)
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// One per CPU: a CPU's TSS can't be shared, and a busy TSS descriptor can't
+// be loaded twice, so every CPU gets a GDT of its own.
+struct gdt {
+    uint64_t entries[GDT_ENTRIES];
+    struct tss tss;
+    uint8_t ist_stack[IST_STACK_SIZE] __attribute__((aligned(16)));
+};
+
+void init_gdt(struct gdt *gdt);
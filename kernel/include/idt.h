@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+// Software interrupt that reschedules through the full interrupt path
+#define RESCHED_VECTOR 0x30
+
+// Local APIC timer, reschedule IPI and spurious interrupts
+#define TIMER_VECTOR       0x31
+#define RESCHED_IPI_VECTOR 0x32
+#define SPURIOUS_VECTOR    0xFF
+
 // The IDT entry structure
 struct idt_entry {
     uint16_t isr_low;   // The lower 16 bits of the ISR's address
@@ -22,5 +30,7 @@ struct idt_ptr {
 
 // Function to initialize the IDT
 void init_idt(void);
+void load_idt(void);
+void idt_set_ist(uint8_t vector, uint8_t ist);
 
 #endif
\ No newline at end of file
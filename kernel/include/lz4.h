@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// --- Configuration ---
+#define LZ4_FRAME_MAGIC    0x184D2204
+#define LZ4_OK             0
+#define LZ4_ERR_FORMAT    -1
+
+int64_t lz4_content_size(const void *src, size_t src_size);
+int64_t unlz4(const void *src, size_t src_size, void *dst, size_t dst_size);
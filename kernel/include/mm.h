@@ -14,4 +14,9 @@ extern struct memory_header *free_list_start;
 void init_mm(void* start_addr, size_t total_size);
 void* malloc(size_t size);
 void* realloc(void* ptr, size_t size);
-void free(void* ptr);
\ No newline at end of file
+void free(void* ptr);
+size_t heap_in_use(void);
+
+#ifdef CONFIG_BENCH
+void bench_malloc(void);
+#endif
\ No newline at end of file
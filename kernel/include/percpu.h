@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <gdt.h>
+
+#define MAX_CPUS 64
+
+struct tcb;
+
+// Everything there is one of per CPU. GS base points at it, so a CPU finds
+// its own with a single gs-relative load. Subsystems with bigger per-CPU
+// state keep an array indexed by id instead (see sched.c, timer.c).
+struct cpu {
+    struct cpu *self;         // gs:0
+    uint32_t id;              // Index into cpus[], 0 is the BSP
+    uint32_t lapic_id;
+    struct tcb *current;      // Running task
+    uint64_t kernel_rsp;      // Its kernel stack, for syscalls from ring 3
+    uint64_t user_rsp;        // Scratch for syscall_entry
+    uint64_t tlb_gen;         // Last vmm TLB generation this CPU flushed for
+    struct tcb *fpu_owner;    // Last task whose FPU state was loaded here
+    uint32_t softirq_pending; // Bit n set = softirq n raised
+    bool in_softirq;          // Running softirqs, see irq_exit()
+    uint64_t irq_start;       // TSC the hard interrupt we're in came in, or 0
+    bool online;
+    struct gdt gdt;
+};
+
+extern struct cpu *cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+
+// Only stable while this CPU can't switch tasks (interrupts off): a task
+// can move to another CPU whenever it's preempted.
+static inline struct cpu *this_cpu(void) {
+    struct cpu *cpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t this_cpu_id(void) {
+    uint32_t id;
+    asm volatile ("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(struct cpu, id)));
+    return id;
+}
+
+// The task running on this CPU. Seen from a task that's always itself,
+// whichever CPU it's on, so unlike this_cpu() it's fine with interrupts on.
+static inline struct tcb *this_task(void) {
+    struct tcb *task;
+    asm ("mov %%gs:%c1, %0" : "=r"(task) : "i"(offsetof(struct cpu, current)));
+    return task;
+}
+
+// A counter split across CPUs: adding only touches this CPU's own cache
+// line, reading adds them all up (exact only while nobody is adding). For
+// hot statistics that are read rarely.
+struct counter_shard {
+    int64_t value;
+} __attribute__((aligned(64)));
+
+typedef struct {
+    struct counter_shard shard[MAX_CPUS];
+} percpu_counter_t;
+
+// Fine with interrupts on: a task moving CPUs halfway just adds to the
+// other shard, and the add is atomic against interrupts on this one.
+static inline void percpu_counter_add(percpu_counter_t *counter, int64_t delta) {
+    __atomic_add_fetch(&counter->shard[this_cpu_id()].value, delta, __ATOMIC_RELAXED);
+}
+
+static inline int64_t percpu_counter_read(percpu_counter_t *counter) {
+    int64_t sum = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) sum += __atomic_load_n(&counter->shard[i].value, __ATOMIC_RELAXED);
+    return sum;
+}
+
+// A log2 histogram, split across CPUs the same way. Bucket n counts values
+// in [2^n, 2^(n+1)), bucket 0 also takes 0 and the last one everything
+// too big for the others.
+#define HIST_BUCKETS 32
+
+struct hist_shard {
+    uint64_t bucket[HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+typedef struct {
+    struct hist_shard shard[MAX_CPUS];
+} percpu_hist_t;
+
+// Interrupts off: the increment isn't atomic, only this CPU touches its shard
+static inline void percpu_hist_add(percpu_hist_t *hist, uint64_t value) {
+    uint32_t bucket = value ? bsr(value) : 0;
+    if (bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+    hist->shard[this_cpu_id()].bucket[bucket]++;
+}
+
+// All CPUs' shards added up into buckets[HIST_BUCKETS]
+static inline void percpu_hist_read(percpu_hist_t *hist, uint64_t *buckets) {
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) buckets[b] = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+            buckets[b] += __atomic_load_n(&hist->shard[i].bucket[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void init_percpu(void);
+void init_smp(void);
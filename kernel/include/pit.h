@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIT_FREQ 1193182
+
+void init_pit(uint32_t frequency);
+void pit_gate_start(uint32_t us);
+bool pit_gate_done(void);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+extern uint64_t hhdm_offset;
+
+// Physical <-> higher half direct map
+#define PHYS_TO_VIRT(p) ((void *)((uint64_t)(p) + hhdm_offset))
+#define VIRT_TO_PHYS(v) ((uint64_t)(v) - hhdm_offset)
+
+void init_pmm(uint64_t heap_base, uint64_t heap_len);
+uint64_t pmm_alloc(void);
+uint64_t pmm_alloc_zeroed(void);
+void pmm_free(uint64_t phys);
+void pmm_ref(uint64_t phys);
+uint64_t pmm_refs(uint64_t phys);
+uint64_t pmm_free_pages(void);
+uint64_t pmm_total_pages(void);
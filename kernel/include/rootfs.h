@@ -1,6 +1,8 @@
 #pragma once
 
-#include <rootfs.h>
+#include <stdint.h>
+
+#define ROOTFS_PATH_MAX 256
 
 struct tar_header {
     char name[100];
@@ -14,12 +16,44 @@ struct tar_header {
     char linkname[100];
     char magic[6];     // "ustar"
     char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];  // Leading directories of long paths
+};
+
+// Tar typeflags we care about
+#define ROOTFS_TYPE_FILE '0'
+#define ROOTFS_TYPE_DIR  '5'
+
+// One archive member, as indexed by init_rootfs
+struct rootfs_entry {
+    const char *path; // Normalised: no leading "./" or "/", no trailing "/"
+    uint32_t hash;
+    char type;        // ROOTFS_TYPE_*
+    uint32_t mode;
+    uint64_t mtime;
+    void *data;
+    uint64_t size;
 };
 
+// Module formats, detected by magic (see init_rootfs)
+#define ROOTFS_FORMAT_UNKNOWN 0
+#define ROOTFS_FORMAT_GZIP    1
+#define ROOTFS_FORMAT_LZ4     2
+#define ROOTFS_FORMAT_TAR     3  // Uncompressed, used in place
+
+// read_rootfs() hands out pointers into the archive itself (which may be the
+// Limine module), so the data must be treated as read-only.
 typedef struct {
     void* data;      // Pointer to the actual file content
     uint64_t size;   // Actual size of the file in bytes
 } rootfs_file_t;
 
 void init_rootfs(void);
-rootfs_file_t read_rootfs(const char *path);
\ No newline at end of file
+rootfs_file_t read_rootfs(const char *path);
+
+#ifdef CONFIG_BENCH
+void bench_rootfs(void);
+#endif
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bottom halves: the part of interrupt handling that can run with
+// interrupts back on. A hard interrupt handler does the minimum, raises a
+// softirq and returns through irq_exit(), which runs whatever was raised
+// with interrupts enabled before the scheduler gets to look. irq_enter()
+// at the start notes when the interrupt came in, for the latency
+// histograms. Softirqs never
+// sleep, and run on the CPU that raised them, one at a time.
+
+enum {
+    SOFTIRQ_TIMER,      // Timer wheel callbacks
+    SOFTIRQ_TASKLET,    // tasklet_schedule()
+    NR_SOFTIRQS
+};
+
+// Rounds of newly raised softirqs irq_exit() goes through before it leaves
+// the rest for the next interrupt
+#define SOFTIRQ_MAX_RESTART 8
+
+// A one-off bottom half for drivers: fn(tasklet) runs once in softirq
+// context after tasklet_schedule(), on the CPU that scheduled it
+struct tasklet {
+    struct tasklet *next;
+    bool pending;
+    void (*fn)(struct tasklet *);
+    void *data;
+};
+
+void open_softirq(int nr, void (*handler)(void));
+void raise_softirq(int nr);
+uint64_t irq_enter(void);
+void irq_exit(uint64_t outer);
+bool in_softirq(void);
+
+void tasklet_init(struct tasklet *tasklet, void (*fn)(struct tasklet *), void *data);
+bool tasklet_schedule(struct tasklet *tasklet);
+
+void init_softirq(void);
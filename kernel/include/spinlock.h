@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+
+// Spinlocks. Anything also taken from interrupt context must be locked with
+// the _irqsave variants, or an interrupt on the same CPU would spin on a lock
+// its own CPU holds.
+//
+// spinlock_t is a ticket lock: CPUs get the lock in the order they asked for
+// it, so none can be starved. Everyone spins on the same word though, which
+// gets expensive when many CPUs pile up on one lock. mcs_lock_t has each
+// waiter spin on its own node instead, and costs an extra node per holder:
+// use it for locks with long critical sections that see real contention.
+//
+// Built with LOCK_STAT=1, every lock counts how often it was taken, how
+// often it had to wait and for how many cycles. Locks given a name with
+// spin_lock_name()/mcs_lock_name() show up in lock_stat_dump().
+
+#ifdef CONFIG_LOCK_STAT
+struct lock_stat {
+    const char *name;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    struct lock_stat *next;
+};
+
+void lock_stat_register(struct lock_stat *stat, const char *name);
+void lock_stat_dump(void);
+
+// Only ever called by the lock holder, so no atomics needed
+static inline void lock_stat_account(struct lock_stat *stat, uint64_t wait_start) {
+    stat->acquired++;
+    if (wait_start) {
+        stat->contended++;
+        stat->wait_cycles += rdtsc() - wait_start;
+    }
+}
+#define LOCK_STAT_WAIT_START() rdtsc()
+#else
+#define LOCK_STAT_WAIT_START() 0
+#endif
+
+typedef struct {
+    volatile uint16_t owner;   // Ticket being served
+    volatile uint16_t next;    // Next ticket to hand out
+#ifdef CONFIG_LOCK_STAT
+    struct lock_stat stat;
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->owner = 0;
+    lock->next = 0;
+}
+
+static inline void spin_lock_name(spinlock_t *lock, const char *name) {
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_register(&lock->stat, name);
+#else
+    (void)lock; (void)name;
+#endif
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t wait_start = 0;
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        wait_start = LOCK_STAT_WAIT_START();
+        while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) cpu_relax();
+    }
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_account(&lock->stat, wait_start);
+#else
+    (void)wait_start;
+#endif
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+// MCS queue lock. Every holder or waiter brings a node (usually on its
+// stack) and passes the same one to unlock.
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile uint32_t locked;
+};
+
+typedef struct {
+    struct mcs_node *tail;     // Last in line, NULL when free
+#ifdef CONFIG_LOCK_STAT
+    struct lock_stat stat;
+#endif
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT { NULL }
+
+static inline void mcs_lock_init(mcs_lock_t *lock) {
+    lock->tail = NULL;
+}
+
+static inline void mcs_lock_name(mcs_lock_t *lock, const char *name) {
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_register(&lock->stat, name);
+#else
+    (void)lock; (void)name;
+#endif
+}
+
+static inline void mcs_lock(mcs_lock_t *lock, struct mcs_node *node) {
+    node->next = NULL;
+    node->locked = 1;
+
+    // 1. Get in line, and if someone was ahead, wait for them to hand over
+    struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t wait_start = 0;
+    if (prev) {
+        wait_start = LOCK_STAT_WAIT_START();
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) cpu_relax();
+    }
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_account(&lock->stat, wait_start);
+#else
+    (void)wait_start;
+#endif
+}
+
+static inline void mcs_unlock(mcs_lock_t *lock, struct mcs_node *node) {
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        // 1. Nobody behind us: free the lock, unless someone is just getting in line
+        struct mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) cpu_relax();
+    }
+
+    // 2. Hand it straight to the next in line
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node) {
+    uint64_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node, uint64_t flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
@@ -1,3 +1,26 @@
 #pragma once
 
-void init_syscall(void);
\ No newline at end of file
+// Syscall numbers: rax, arguments in rdi, rsi, rdx, r10, r8, r9
+#define SYS_HELLOWORLD    1
+#define SYS_OPEN          2
+#define SYS_READ          3
+#define SYS_PREAD         4
+#define SYS_LSEEK         5
+#define SYS_CLOSE         6
+#define SYS_MMAP          7
+#define SYS_MUNMAP        8
+#define SYS_YIELD         9
+#define SYS_NANOSLEEP     10
+#define SYS_CLOCK_GETTIME 11
+#define SYS_EXIT          12
+#define SYS_GETTID        13
+#define SYS_JOIN          14
+#define SYS_TASK_STATS    15
+#define SYS_SCHED_HIST    16
+#define SYS_BRK           17
+
+void init_syscall(void);
+
+#ifdef CONFIG_BENCH
+void bench_syscall(void);
+#endif
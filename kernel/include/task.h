@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <spinlock.h>
+#include <percpu.h>
+
+#define STACK_SIZE 8192
+
+// Kernel stacks live in their own part of the higher half. Every slot is an
+// unmapped guard page followed by the stack, so running off the bottom of a
+// stack faults instead of scribbling over the one below.
+#define KSTACK_BASE      0xFFFFC00000000000ull
+#define KSTACK_SLOT_SIZE (STACK_SIZE + PAGE_SIZE)
+
+// Released stacks kept mapped for the next create_task
+#define KSTACK_CACHE_MAX 16
+
+// Scheduling priorities: 0 is the most urgent, the last one is the idle task's
+#define SCHED_PRIORITIES   32
+#define SCHED_PRIO_HIGH    0
+#define SCHED_PRIO_DEFAULT 16
+#define SCHED_PRIO_LOW     (SCHED_PRIORITIES - 2)
+#define SCHED_PRIO_IDLE    (SCHED_PRIORITIES - 1)
+
+// Default time slice, in microseconds
+#define SCHED_DEFAULT_SLICE_US 50000
+
+// A task that left its CPU less than this long ago probably still has its
+// working set in that CPU's caches, so it's only stolen if nothing else is
+#define SCHED_MIGRATION_COST_US 500
+
+// Task states
+#define TASK_READY   0 // On a run queue
+#define TASK_RUNNING 1 // On the CPU
+#define TASK_BLOCKED 2 // Waiting, not on any run queue
+#define TASK_DEAD    3 // Exited, waiting to be joined or reaped
+
+// Task IDs: every task gets a new one, they aren't reused
+#define TID_HASH_SIZE 256
+
+// Scheduler latency histograms, see sched_hist_dump(). Nanoseconds,
+// HIST_BUCKETS log2 buckets each.
+#define SCHED_HIST_RQ_DELAY 0 // READY until it got a CPU
+#define SCHED_HIST_SLICE    1 // How long a task kept the CPU each time it got it
+#define SCHED_HIST_IRQ_WAKE 2 // Interrupt that woke a task until the task ran
+#define SCHED_HISTS         3
+
+// One task's numbers, as task_snapshot() and SYS_TASK_STATS hand them out
+struct task_stats {
+    uint32_t tid;
+    int32_t state;
+    int32_t priority;
+    uint32_t cpu;           // Last ran on
+    uint64_t age_ns;        // Since it was created
+    uint64_t run_ns;
+    uint64_t nr_voluntary;
+    uint64_t nr_involuntary;
+    uint64_t nr_wakeups;
+    uint64_t wake_avg_ns;
+    uint64_t wake_max_ns;
+};
+
+typedef struct tcb {
+    uint64_t rsp;           // Saved by context_switch while off the CPU
+    int state;
+    int priority;
+    uint64_t slice_end;     // TSC deadline for being preempted
+    uint32_t cpu;           // Whose run queue it's on, or last ran on
+    bool pinned;            // Never moved to another CPU
+    uint64_t last_ran;      // TSC when it last left the CPU
+
+    uint32_t tid;
+    uint32_t parent;        // TID of the task that created it
+    int exit_code;          // Valid once DEAD
+    bool detached;          // Reaped on exit, nobody joins it
+    struct tcb *joiner;     // Blocked in task_join() on us
+
+    // Accounting, all kept up to date by the scheduler (TSC ticks)
+    uint64_t created;       // TSC when it was made
+    uint64_t switched_in;   // TSC when it last got the CPU
+    uint64_t run_time;      // Total time on a CPU, not counting the current run
+    uint64_t woken_at;      // TSC of the sched_wake() it hasn't run since, or 0
+    uint64_t wake_total;    // Summed and worst wake-up latency
+    uint64_t wake_max;
+    uint64_t nr_wakeups;
+    uint64_t nr_voluntary;  // Switches away because it blocked, yielded or exited
+    uint64_t nr_involuntary; // Preempted
+    uint64_t ready_since;   // TSC it last became READY
+    uint64_t oncpu_since;   // TSC it last took the CPU from another task
+    uint64_t irq_woken_at;  // Start of the interrupt that woke it, or 0
+
+    uint32_t slot;          // Stack slot this TCB owns, for life
+    bool stack_mapped;
+    uint64_t stack_top;     // 0 for the boot task (Limine's stack)
+    struct vm_space *space; // Address space, NULL for the kernel's
+    uint64_t user_rip;      // Where a program's task starts, see create_user_task()
+    uint64_t user_rsp;
+    void *fpu_state;        // XSAVE area, from the first #NM on; kept like the stack
+    bool fpu_used;          // fpu_state holds this task's state
+    uint32_t fpu_cpu;       // CPU (plus one) whose registers it was last loaded into
+
+    struct tcb *next;       // All tasks
+    struct tcb *prev;
+    struct tcb *pool_next;  // TCB pool free lists, or the reaper's list once DEAD
+    struct tcb *hash_next;  // TID hash chain
+    struct tcb *rq_next;    // Run queue (same priority)
+    struct tcb *rq_prev;
+
+    struct tcb *wait_next;  // Wait queue while BLOCKED
+} tcb_t;
+
+// The task running on this CPU
+#define current_task ((tcb_t *)this_task())
+
+extern tcb_t *task_list;
+extern bool scheduler_enabled;
+
+void init_tasks(void);
+tcb_t *adopt_task(int priority);
+tcb_t *create_task(void *entry_point);
+tcb_t *create_task_on(void *entry_point, uint32_t cpu);
+tcb_t *create_task_pinned(void *entry_point, uint32_t cpu);
+tcb_t *create_user_task(struct vm_space *space, uint64_t entry, uint64_t stack_top);
+void destroy_task(tcb_t *task);
+void task_exit(int code) __attribute__((noreturn));
+int task_detach(tcb_t *task);
+int task_join(uint32_t tid, int *code);
+int64_t sys_join(uint64_t tid, int *code);
+uint32_t task_snapshot(struct task_stats *stats, uint32_t max);
+int64_t sys_task_stats(struct task_stats *stats, uint64_t max);
+void task_top(void);
+
+void init_sched(void);
+void sched_start_ap(void);
+uint32_t sched_pick_cpu(void);
+void sched_enqueue(tcb_t *task);
+void sched_dequeue(tcb_t *task);
+void sched_set_priority(tcb_t *task, int priority);
+void sched_set_timeslice(int priority, uint32_t us);
+void sched_block(spinlock_t *release);
+void sched_exit(spinlock_t *release) __attribute__((noreturn));
+void sched_wake(tcb_t *task);
+void yield(void);
+void schedule(void);
+void sched_tick(void);
+void sched_stats(uint64_t *switches, uint64_t *steals);
+int64_t sys_sched_hist(uint64_t which, uint64_t *buckets);
+void sched_hist_dump(void);
+
+#ifdef CONFIG_BENCH
+void bench_sched(void);
+void bench_steal(void);
+void bench_spawn(void);
+uint64_t bench_on_cpus(void (*fn)(void), uint32_t ncpus);
+#endif
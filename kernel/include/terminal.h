@@ -9,4 +9,6 @@ void putc(char c);
 void puts(const char *str);
 void scroll(struct limine_framebuffer *fb);
 void clrscr(void);
-void printf(const char *fmt, ...);
\ No newline at end of file
+void printf(const char *fmt, ...);
+void init_console(void);
+void console_panic(void);
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A kernel timer: fn(timer) runs from the timer softirq once the deadline
+// has passed. The struct can live anywhere (on a stack, in a TCB) as long as
+// it outlives the timer or is cancelled first. It fires on the CPU that
+// added it.
+struct timer {
+    struct timer *next;         // Wheel slot list
+    struct timer **pprev;
+    uint64_t expires;           // In wheel ticks
+    uint8_t level;
+    uint8_t index;
+    bool pending;
+    uint32_t cpu;               // Whose wheel it's on
+    void (*fn)(struct timer *);
+    void *data;
+};
+
+void init_timers(void);
+void timer_init(struct timer *timer, void (*fn)(struct timer *), void *data);
+void timer_add(struct timer *timer, uint64_t deadline);
+void timer_add_us(struct timer *timer, uint64_t us);
+bool timer_cancel(struct timer *timer);
+bool timer_pending(struct timer *timer);
+void run_timers(uint64_t now);
+uint64_t timer_next_deadline(void);
+
+#ifdef CONFIG_BENCH
+void bench_timers(void);
+#endif
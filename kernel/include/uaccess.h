@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <vmm.h>
+
+// Getting at a program's memory from a syscall. A pointer from a program is
+// only used once access_ok() says all of it is in the user half, and only
+// through these helpers: a page the program doesn't have faults, and the
+// fault ends the copy with -EFAULT instead of panicking (see uaccess.c).
+
+static inline bool access_ok(const void *ptr, uint64_t len) {
+    uint64_t addr = (uint64_t)ptr;
+    return len <= USER_END && addr <= USER_END - len;
+}
+
+int copy_from_user(void *dst, const void *src, uint64_t len);
+int copy_to_user(void *dst, const void *src, uint64_t len);
+int64_t strncpy_from_user(char *dst, const char *src, uint64_t size);
+bool uaccess_fixup(uint64_t *rip);
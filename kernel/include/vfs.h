@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VFS_NAME_MAX 256
+#define VFS_PATH_MAX 512 // Longest path a program may pass in
+
+// Node types
+#define VFS_FILE 1
+#define VFS_DIR  2
+
+struct vfs_node;
+
+// A filesystem driver. mount() fills in the tree below the mount point,
+// read() serves file data and data() says where a file's bytes already sit
+// in memory (for zero-copy users like mmap). Anything left NULL is not
+// supported.
+struct vfs_fs {
+    const char *name;
+    int (*mount)(struct vfs_node *mountpoint, void *source);
+    int64_t (*read)(struct vfs_node *node, void *buf, uint64_t offset, uint64_t len);
+    void *(*data)(struct vfs_node *node);
+};
+
+// A dentry and inode in one: the tree lives entirely in memory
+struct vfs_node {
+    const char *name;           // This component only, "" for the root
+    uint32_t name_len;
+    uint32_t hash;              // Of (parent, name), for the dentry cache
+    int type;                   // VFS_FILE or VFS_DIR
+    uint32_t mode;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+
+    struct vfs_fs *fs;          // Driver that owns this node
+    void *fs_data;              // Driver private (e.g. where the data is)
+    void *pages;                // Page-aligned copy of the data, see vfs_pages()
+
+    struct vfs_node *parent;
+    struct vfs_node *children;  // First child, in creation order
+    struct vfs_node *last_child;
+    struct vfs_node *next;      // Next sibling
+    struct vfs_node *hash_next; // Dentry cache chain
+};
+
+struct vfs_stat {
+    uint64_t ino;
+    int type;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+void init_vfs(void);
+struct vfs_node *vfs_root(void);
+int vfs_mount(const char *path, struct vfs_fs *fs, void *source);
+
+// For drivers: create (or find) a node, making missing parent directories
+struct vfs_node *vfs_create(struct vfs_node *base, const char *path, int type, struct vfs_fs *fs);
+
+struct vfs_node *vfs_lookup(const char *path);
+struct vfs_node *vfs_lookup_at(struct vfs_node *base, const char *path);
+int vfs_stat(const char *path, struct vfs_stat *st);
+void vfs_stat_node(struct vfs_node *node, struct vfs_stat *st);
+struct vfs_node *vfs_readdir(struct vfs_node *dir, struct vfs_node *prev);
+int64_t vfs_read(struct vfs_node *node, void *buf, uint64_t offset, uint64_t len);
+void *vfs_data(struct vfs_node *node);
+void *vfs_pages(struct vfs_node *node);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <spinlock.h>
+
+// Page table entry bits
+#define PTE_PRESENT   (1ull << 0)
+#define PTE_WRITE     (1ull << 1)
+#define PTE_USER      (1ull << 2)
+#define PTE_PWT       (1ull << 3)
+#define PTE_PCD       (1ull << 4)
+#define PTE_HUGE      (1ull << 7)
+#define PTE_GLOBAL    (1ull << 8)
+#define PTE_SHARED    (1ull << 9)  // Ignored by the CPU: the page isn't the address space's to free
+#define PTE_COW       (1ull << 10) // Ignored by the CPU: read-only until written, then copied
+#define PTE_NX        (1ull << 63)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ull
+
+// mmap() hands out addresses from here (far above Limine's identity map)
+#define MMAP_BASE 0x0000700000000000ull
+#define MMAP_END  0x00007F0000000000ull
+
+// The user half of an address space: PML4 slots 0-255. The kernel half above
+// is the same in every address space.
+#define USER_END 0x0000800000000000ull
+
+#define PROT_READ  1
+#define PROT_WRITE 2
+#define PROT_EXEC  4
+
+struct vfs_node;
+struct fd_table;
+
+// A range of a program's address space and where its pages come from: a
+// file up to file_end and zeroes after it, or zeroes all the way (node is
+// NULL). A page only gets memory when it's first touched, see vmm_fault().
+struct vma {
+    uint64_t start;          // Page aligned
+    uint64_t end;
+    uint32_t prot;           // PROT_*
+    struct vfs_node *node;
+    uint64_t offset;         // File offset of start, page aligned
+    uint64_t file_end;       // Address the file's bytes stop at
+    struct vma *next;        // Sorted by address
+};
+
+// A program's address space
+struct vm_space {
+    uint64_t pml4;           // Physical address of its PML4
+    uint64_t id;             // Never reused, unlike the PML4's page
+    uint64_t tlb_gen;        // Bumped when one of its user mappings goes away
+    spinlock_t lock;         // VMAs, and faulting pages in
+    struct vma *vmas;
+    uint64_t brk_start;      // Heap, grown and shrunk by brk()
+    uint64_t brk;
+    uint64_t mmap_next;      // Where the next mmap() goes
+    struct fd_table *fds;    // Open files, from the first open() on
+};
+
+void init_vmm(void);
+void init_vmm_ap(void);
+uint64_t vmm_current(void);
+uint64_t vmm_kernel(void);
+uint64_t vmm_nx(void);
+int vmm_map(uint64_t pml4, uint64_t virt, uint64_t phys, uint64_t flags);
+uint64_t vmm_unmap(uint64_t pml4, uint64_t virt);
+uint64_t vmm_translate(uint64_t pml4, uint64_t virt);
+uint64_t vmm_entry(uint64_t pml4, uint64_t virt);
+int vmm_copy_user(uint64_t dst, uint64_t src);
+struct vm_space *vmm_new_space(void);
+void vmm_free_space(struct vm_space *space);
+void vmm_switch_space(struct vm_space *space);
+void vmm_flush_space(struct vm_space *space);
+void vmm_flush_lazy(void);
+void vmm_sync_tlb(void);
+
+struct vm_space *vmm_clone_space(struct vm_space *src);
+int vmm_fault(struct vm_space *space, uint64_t addr, uint64_t error);
+void page_fault(uint64_t error, uint64_t *rip, uint64_t rsp, uint64_t rflags);
+int vma_add(struct vm_space *space, uint64_t start, uint64_t end, uint32_t prot,
+            struct vfs_node *node, uint64_t offset, uint64_t file_end);
+int vma_populate(struct vm_space *space, uint64_t start, uint64_t end);
+int64_t vma_mmap(struct vm_space *space, uint64_t len, uint32_t prot, struct vfs_node *node, uint64_t offset);
+int vma_munmap(struct vm_space *space, uint64_t start, uint64_t end);
+
+int64_t sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t offset);
+int64_t sys_munmap(uint64_t addr, uint64_t len);
+int64_t sys_brk(uint64_t addr);
+
+#ifdef CONFIG_BENCH
+void bench_fault(void);
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <task.h>
+#include <spinlock.h>
+
+// Tasks blocked until someone wakes them, woken in FIFO order
+typedef struct {
+    spinlock_t lock;
+    tcb_t *head;
+    tcb_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL, NULL }
+
+void wait_queue_init(wait_queue_t *wq);
+void wait_on(wait_queue_t *wq);
+void wait_on_locked(wait_queue_t *wq);
+void wake_one(wait_queue_t *wq);
+void wake_one_locked(wait_queue_t *wq);
+void wake_all(wait_queue_t *wq);
+
+int wait_on_timeout(wait_queue_t *wq, uint64_t us);
+
+void sleep_us(uint64_t us);
+void sleep_ms(uint64_t ms);
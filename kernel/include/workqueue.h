@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred work: fn(work) runs later in a kernel worker task, so unlike a
+// softirq it may sleep, take its time and print. Every CPU has its own
+// queue and worker.
+struct work {
+    struct work *next;
+    bool pending;
+    void (*fn)(struct work *);
+    void *data;
+};
+
+// Workers run above normal tasks, so deferred work doesn't sit behind them
+#define WORKER_PRIORITY 8
+
+void init_workqueues(void);
+void work_init(struct work *work, void (*fn)(struct work *), void *data);
+bool queue_work(struct work *work);
+bool queue_work_on(uint32_t cpu, struct work *work);
+bool work_pending(struct work *work);
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <idt.h>
+#include <panic.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <apic.h>
+
+// The local APIC, through its MMIO page (xAPIC mode). The legacy PIC stays
+// around for the other IRQs, this is only used for its timer and for IPIs.
+
+static volatile uint32_t *lapic = NULL;
+
+bool lapic_present(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    return d & (1 << 9);
+}
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Interrupt another CPU. Call with interrupts off, the ICR is two writes.
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) cpu_relax();
+}
+
+// Run on every CPU. The MMIO page is at the same address for all of them.
+void init_lapic(void) {
+    if (!lapic_present()) return;
+
+    // 1. Make sure it's on and find it
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    wrmsr(MSR_APIC_BASE, base | (1 << 11));
+    uint64_t phys = base & PTE_ADDR_MASK;
+
+    // 2. Reach it through the HHDM. Limine only maps it there on some
+    // revisions, so map it ourselves (uncached) if it's missing.
+    uint64_t virt = (uint64_t)PHYS_TO_VIRT(phys);
+    if (lapic == NULL && vmm_translate(vmm_kernel(), virt) != phys) {
+        if (vmm_map(vmm_kernel(), virt, phys, PTE_WRITE | PTE_PCD | PTE_PWT | vmm_nx()) != 0) {
+            panic("Could not map the local APIC.");
+        }
+    }
+    lapic = (volatile uint32_t *)virt;
+
+    // 3. Accept everything, and software-enable it with its spurious vector
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+}
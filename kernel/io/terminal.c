@@ -3,6 +3,9 @@
 #include <stdarg.h>
 #include <framebuffer.h>
 #include <string.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <workqueue.h>
 
 uint64_t g_cursor_x = 0;
 uint64_t g_cursor_y = 0;
@@ -21,6 +24,50 @@ char g_ansi_buffer[16];
 int g_ansi_idx = 0;
 bool g_is_bold = false;
 
+// Console output goes through a log buffer. putc, puts and printf only
+// append to it, holding the console lock with interrupts off just for that,
+// and the console work draws it on the framebuffer later, from a worker
+// with interrupts on. Until init_console(), and from a panic on, whoever
+// writes draws it right away.
+//
+// The console lock covers the log buffer, so lines from different CPUs
+// don't get mixed up. It's recursive, so printf can call putc and a panic
+// halfway through a line still gets printed, and taken with interrupts off
+// since interrupt handlers print too. The globals above belong to whoever
+// set console_drawing.
+#define LOG_BUF_SIZE (64 * 1024)
+
+static char log_buf[LOG_BUF_SIZE];
+static uint64_t log_head = 0;          // Next byte to write, counts up forever
+static uint64_t log_tail = 0;          // Next byte to draw
+static bool console_deferred = false;
+static bool console_sync = false;      // Panicking
+static bool console_drawing = false;
+static struct work console_work;
+
+static spinlock_t console_lock = SPINLOCK_INIT;
+static volatile uint32_t console_owner = UINT32_MAX;
+static uint32_t console_depth = 0;
+
+static uint64_t console_enter(void) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpus[0] ? this_cpu_id() : 0; // Before init_percpu there's just us
+    if (console_owner != cpu) {
+        spin_lock(&console_lock);
+        console_owner = cpu;
+    }
+    console_depth++;
+    return flags;
+}
+
+static void console_leave(uint64_t flags) {
+    if (--console_depth == 0) {
+        console_owner = UINT32_MAX;
+        spin_unlock(&console_lock);
+    }
+    irq_restore(flags);
+}
+
 static uint32_t ansi_to_hex(int code, bool is_background, bool bold) {
     static const uint32_t colors[] = {
         0x000000, 0xAA0000, 0x00AA00, 0xAA5500,
@@ -63,11 +110,14 @@ void scroll(struct limine_framebuffer *fb) {
 void clrscr(void) {
     if (!fb_req.response || fb_req.response->framebuffer_count < 1) return;
     struct limine_framebuffer *fb = fb_req.response->framebuffers[0];
+    spin_lock_name(&console_lock, "console"); // First thing kmain does
+    uint64_t flags = console_enter();
     for (uint64_t y = 0; y < fb->height; y++) {
         uint32_t *row = (uint32_t *)((uint8_t *)fb->address + y * fb->pitch);
         for (uint64_t x = 0; x < fb->width; x++) row[x] = g_bg_color;
     }
     g_cursor_x = 0; g_cursor_y = 0;
+    console_leave(flags);
 }
 
 static void update_cursor(bool visible) {
@@ -83,7 +133,7 @@ static void update_cursor(bool visible) {
     }
 }
 
-void putc(char c) {
+static void draw_putc(char c) {
     if (!fb_req.response || fb_req.response->framebuffer_count < 1) return;
     struct limine_framebuffer *fb = fb_req.response->framebuffers[0];
 
@@ -172,8 +222,74 @@ void putc(char c) {
     update_cursor(true);
 }
 
+// Call with the console lock held. When the buffer is full the oldest
+// bytes go.
+static void console_putc(char c) {
+    log_buf[log_head++ % LOG_BUF_SIZE] = c;
+    if (log_head - log_tail > LOG_BUF_SIZE) log_tail = log_head - LOG_BUF_SIZE;
+}
+
+// Draw what's in the log buffer, a chunk at a time so the console lock is
+// only held to copy it out. One CPU draws at a time. Whoever stops looks
+// again, something may have come in after its last look while the next
+// writer still saw it drawing.
+static void console_drain(void) {
+    char chunk[256];
+    while (!__atomic_exchange_n(&console_drawing, true, __ATOMIC_ACQUIRE)) {
+        while (1) {
+            uint64_t flags = console_enter();
+            uint64_t n = log_head - log_tail;
+            if (n > sizeof(chunk)) n = sizeof(chunk);
+            for (uint64_t i = 0; i < n; i++) chunk[i] = log_buf[(log_tail + i) % LOG_BUF_SIZE];
+            log_tail += n;
+            console_leave(flags);
+
+            if (n == 0) break;
+            for (uint64_t i = 0; i < n; i++) draw_putc(chunk[i]);
+        }
+        __atomic_store_n(&console_drawing, false, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&log_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE)) break;
+    }
+}
+
+static void console_work_fn(struct work *work) {
+    (void)work;
+    console_drain();
+}
+
+// After appending: get it drawn, by a worker once there are some
+static void console_kick(void) {
+    if (console_deferred && !console_sync) queue_work(&console_work);
+    else console_drain();
+}
+
+// From here on a worker draws the console. Needs the work queues.
+void init_console(void) {
+    work_init(&console_work, console_work_fn, NULL);
+    console_deferred = true;
+    queue_work(&console_work); // Whatever came in meanwhile
+}
+
+// Draw everything right away from now on, whoever was drawing: a panic has
+// to reach the screen, even if it interrupted a draw on this CPU.
+void console_panic(void) {
+    console_sync = true;
+    __atomic_store_n(&console_drawing, false, __ATOMIC_RELEASE);
+    console_drain();
+}
+
+void putc(char c) {
+    uint64_t flags = console_enter();
+    console_putc(c);
+    console_leave(flags);
+    console_kick();
+}
+
 void puts(const char *str) {
-    while (*str) putc(*str++);
+    uint64_t flags = console_enter();
+    while (*str) console_putc(*str++);
+    console_leave(flags);
+    console_kick();
 }
 
 static void int_to_str(uint64_t value, char *buf, size_t buf_size, int base, bool uppercase) {
@@ -205,10 +321,11 @@ static void int_to_str(uint64_t value, char *buf, size_t buf_size, int base, boo
 void printf(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
+    uint64_t flags = console_enter();
 
     for (const char *p = fmt; *p != '\0'; p++) {
         if (*p != '%') {
-            putc(*p);
+            console_putc(*p);
             continue;
         }
 
@@ -238,7 +355,7 @@ void printf(const char *fmt, ...) {
             case 's': {
                 char *s = va_arg(args, char *);
                 if (!s) s = "(null)";
-                while(*s) putc(*s++);
+                while(*s) console_putc(*s++);
                 break;
             }
 
@@ -254,7 +371,7 @@ void printf(const char *fmt, ...) {
 
                 // Handle signed negative
                 if ((*p == 'd' || *p == 'D') && (int64_t)val < 0) {
-                    putc('-');
+                    console_putc('-');
                     val = -(int64_t)val;
                 }
 
@@ -266,12 +383,12 @@ void printf(const char *fmt, ...) {
                 int len = 0;
                 while (buf[len]) len++;
                 while (width > len) {
-                    putc(pad_char);
+                    console_putc(pad_char);
                     width--;
                 }
 
                 char *ptr = buf;
-                while(*ptr) putc(*ptr++);
+                while(*ptr) console_putc(*ptr++);
                 break;
             }
 
@@ -280,30 +397,32 @@ void printf(const char *fmt, ...) {
                 char buf[64];
                 // Pointers usually use lowercase by convention
                 int_to_str(x, buf, 64, 16, false);
-                putc('0'); putc('x');
+                console_putc('0'); console_putc('x');
                 
                 int len = 0;
                 while (buf[len]) len++;
-                for (int i = 0; i < (16 - len); i++) putc('0');
+                for (int i = 0; i < (16 - len); i++) console_putc('0');
 
                 char *ptr = buf;
-                while(*ptr) putc(*ptr++);
+                while(*ptr) console_putc(*ptr++);
                 break;
             }
 
             case 'c':
-                putc((char)va_arg(args, int));
+                console_putc((char)va_arg(args, int));
                 break;
 
             case '%':
-                putc('%');
+                console_putc('%');
                 break;
 
             default:
-                putc('%');
-                putc(*p);
+                console_putc('%');
+                console_putc(*p);
                 break;
         }
     }
+    console_leave(flags);
     va_end(args);
+    console_kick();
 }
\ No newline at end of file
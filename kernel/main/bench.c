@@ -0,0 +1,26 @@
+#include <terminal.h>
+#include <rootfs.h>
+#include <task.h>
+#include <mm.h>
+#include <timer.h>
+#include <clock.h>
+#include <vmm.h>
+#include <elf.h>
+#include <syscall.h>
+#include <bench.h>
+
+#ifdef CONFIG_BENCH
+void run_benchmarks(void) {
+    printf("Running benchmarks...\n");
+    bench_rootfs();
+    bench_sched();
+    bench_steal();
+    bench_spawn();
+    bench_elf();
+    bench_fault();
+    bench_syscall();
+    bench_malloc();
+    bench_timers();
+    bench_clock();
+}
+#endif
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <cpu.h>
+#include <terminal.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <vfs.h>
+#include <task.h>
+#include <elf.h>
+
+// ELF64 loader for static executables from the rootfs. Loading only
+// describes the program's address space: each PT_LOAD segment becomes a VMA
+// backed by the file, and its pages come in when the program first touches
+// them (see vma.c). Read-only pages that are all file are the file's own
+// pages, shared by everyone running the program; .data is copied a page at
+// a time as it's written, and .bss and the heap are zero-filled.
+
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+// Check the headers. Returns the program headers, or NULL.
+static struct elf64_phdr *elf_check(uint8_t *file, uint64_t size) {
+    struct elf64_ehdr *ehdr = (struct elf64_ehdr *)file;
+    if (size < sizeof(struct elf64_ehdr) || ehdr->magic != ELF_MAGIC) return NULL;
+    if (ehdr->class != ELFCLASS64 || ehdr->data != ELFDATA2LSB) return NULL;
+    if (ehdr->type != ET_EXEC || ehdr->machine != EM_X86_64) return NULL; // No dynamic linking
+    if (ehdr->phentsize != sizeof(struct elf64_phdr)) return NULL;
+    if (ehdr->phoff > size || (size - ehdr->phoff) / sizeof(struct elf64_phdr) < ehdr->phnum) return NULL;
+    return (struct elf64_phdr *)(file + ehdr->phoff);
+}
+
+static int add_segment(struct vm_space *space, struct vfs_node *node, struct elf64_phdr *ph) {
+    uint64_t start = ph->vaddr & ~PAGE_MASK;
+    uint64_t end = (ph->vaddr + ph->memsz + PAGE_MASK) & ~PAGE_MASK;
+    uint32_t prot = PROT_READ;
+    if (ph->flags & PF_W) prot |= PROT_WRITE;
+    if (ph->flags & PF_X) prot |= PROT_EXEC;
+
+    // Zeroes only start where there's a .bss: otherwise the last page is
+    // the file's, whatever follows the segment in it
+    uint64_t file_end = ph->memsz > ph->filesz ? ph->vaddr + ph->filesz : end;
+    int err = vma_add(space, start, end, prot, node, ph->offset & ~PAGE_MASK, file_end);
+    return err == -EEXIST ? -ENOEXEC : err; // Segments sharing a page aren't supported
+}
+
+// Describe an executable's PT_LOAD segments in the user half of space. On
+// failure, whatever was added already stays: free the address space.
+int elf_load(struct vfs_node *node, struct vm_space *space, struct elf_image *image) {
+    memset(image, 0, sizeof(struct elf_image));
+    if (node->type != VFS_FILE) return -EACCES;
+
+    uint8_t *file = vfs_pages(node);
+    if (file == NULL) return -ENOMEM;
+    struct elf64_phdr *phdrs = elf_check(file, node->size);
+    if (phdrs == NULL) return -ENOEXEC;
+
+    struct elf64_ehdr *ehdr = (struct elf64_ehdr *)file;
+    for (uint16_t i = 0; i < ehdr->phnum; i++) {
+        struct elf64_phdr *ph = &phdrs[i];
+        if (ph->type != PT_LOAD || ph->memsz == 0) continue;
+
+        // 1. The segment has to be in the file, below the mmap() area, and
+        //    sit at the same offset in its page in memory as in the file
+        if (ph->filesz > ph->memsz || ph->offset > node->size || ph->filesz > node->size - ph->offset) return -ENOEXEC;
+        if (ph->vaddr >= MMAP_BASE || ph->memsz > MMAP_BASE - ph->vaddr) return -ENOEXEC;
+        if ((ph->vaddr & PAGE_MASK) != (ph->offset & PAGE_MASK)) return -ENOEXEC;
+
+        // 2. Add it
+        int err = add_segment(space, node, ph);
+        if (err < 0) return err;
+
+        uint64_t end = (ph->vaddr + ph->memsz + PAGE_MASK) & ~PAGE_MASK;
+        if (end > image->brk) image->brk = end;
+    }
+    image->entry = ehdr->entry;
+    return 0;
+}
+
+// Load a program into a new address space and start it in a task of its
+// own. Returns the task's TID.
+int64_t elf_spawn(const char *path) {
+    struct vfs_node *node = vfs_lookup(path);
+    if (node == NULL) return -ENOENT;
+
+    struct vm_space *space = vmm_new_space();
+    if (space == NULL) return -ENOMEM;
+
+    // 1. The segments, an empty heap after them and a zero-filled stack
+    struct elf_image image;
+    int err = elf_load(node, space, &image);
+    space->brk_start = space->brk = image.brk;
+    uint64_t stack = USER_STACK_TOP - USER_STACK_SIZE;
+    if (err == 0) err = vma_add(space, stack, USER_STACK_TOP, PROT_READ | PROT_WRITE, NULL, 0, 0);
+    if (err < 0) {
+        vmm_free_space(space);
+        return err;
+    }
+
+    // 2. What the ABI has at the entry point's rsp: argc, then NULL-terminated
+    //    argv, envp and auxv. All empty, and the stack is zeroed already.
+    tcb_t *task = create_user_task(space, image.entry, USER_STACK_TOP - 32);
+    if (task == NULL) {
+        vmm_free_space(space);
+        return -ENOMEM;
+    }
+    return task->tid;
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_ELF_LOADS 1000
+
+// Load the same program over and over into fresh address spaces
+void bench_elf(void) {
+    struct vfs_node *node = vfs_lookup("/test.elf");
+    if (node == NULL) return;
+
+    struct elf_image image;
+    uint64_t total = 0;
+    for (int i = 0; i < BENCH_ELF_LOADS; i++) {
+        struct vm_space *space = vmm_new_space();
+        if (space == NULL) return;
+        uint64_t start = rdtsc();
+        int err = elf_load(node, space, &image);
+        total += rdtsc() - start;
+        vmm_free_space(space);
+        if (err < 0) return;
+    }
+    printf("bench: elf_load of /test.elf: %U cycles\n", total / BENCH_ELF_LOADS);
+}
+#endif
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <cpu.h>
+#include <mm.h>
+#include <panic.h>
+#include <terminal.h>
+#include <percpu.h>
+#include <task.h>
+#include <fpu.h>
+
+// Lazy FPU/SSE/AVX switching. The kernel itself is built without them, so
+// only the tasks that use them have any state worth keeping. Every switch
+// leaves CR0.TS set, and the first such instruction a task runs after that
+// traps with #NM, which loads its state and clears TS. So TS still being set
+// when a task leaves the CPU means it didn't touch the registers, and there
+// is nothing to save; only a task that did gets saved on the way out.
+//
+// The registers may also still hold a task's state from the last time it
+// ran on this CPU, when nobody loaded theirs in between. Then #NM doesn't
+// even have to restore, it just clears TS.
+
+static bool use_xsave = false;
+static uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+static uint32_t fpu_size = FXSAVE_SIZE;
+
+static inline void fpu_save(void *area) {
+    if (use_xsave) asm volatile ("xsave64 (%0)" : : "r"(area), "a"(-1), "d"(-1) : "memory");
+    else asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fpu_restore(void *area) {
+    if (use_xsave) asm volatile ("xrstor64 (%0)" : : "r"(area), "a"(-1), "d"(-1) : "memory");
+    else asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+// A task's first state: registers cleared, exceptions masked. A zeroed XSAVE
+// header means every component is in its init state, except MXCSR, which
+// is always loaded from the legacy area.
+static void fpu_init_state(void *area) {
+    memset(area, 0, fpu_size);
+    *(uint16_t *)area = FPU_DEFAULT_FCW;
+    *(uint32_t *)((uint8_t *)area + 24) = FPU_DEFAULT_MXCSR;
+}
+
+static void setup_cpu(void) {
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE | CR0_TS;
+    write_cr0(cr0);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (use_xsave) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (use_xsave) xsetbv(0, xcr0);
+}
+
+// See what the CPU has and turn it on. Every CPU has the same features.
+void init_fpu(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (c & (1 << 26)) {
+        use_xsave = true;
+        if (c & (1 << 28)) xcr0 |= XCR0_AVX;
+    }
+    setup_cpu();
+
+    // The size XSAVE needs for what's enabled in XCR0
+    if (use_xsave) {
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        fpu_size = b;
+    }
+    printf("FPU: %s, %u byte state%s\n", use_xsave ? "XSAVE" : "FXSAVE", fpu_size,
+           (xcr0 & XCR0_AVX) ? ", AVX" : "");
+}
+
+void init_fpu_ap(void) {
+    setup_cpu();
+}
+
+// From __schedule, interrupts off, just before switching away from prev
+void fpu_switch(struct tcb *prev) {
+    uint64_t cr0 = read_cr0();
+    if (cr0 & CR0_TS) return; // Didn't touch it this time round
+    fpu_save(prev->fpu_state);
+    write_cr0(cr0 | CR0_TS);
+}
+
+// #NM: the running task wants the FPU. Interrupts off.
+void fpu_trap(void) {
+    struct cpu *cpu = this_cpu();
+    tcb_t *task = cpu->current;
+    write_cr0(read_cr0() & ~CR0_TS);
+
+    // 1. Still loaded from last time?
+    if (cpu->fpu_owner == task && task->fpu_cpu == cpu->id + 1) return;
+
+    // 2. First use. The area stays with the TCB, like its stack.
+    if (task->fpu_state == NULL) {
+        void *raw = malloc(fpu_size + 63);
+        if (raw == NULL) panic("Not enough memory for a task's FPU state.");
+        task->fpu_state = (void *)(((uint64_t)raw + 63) & ~63ull); // XSAVE wants 64 byte alignment
+    }
+    if (!task->fpu_used) {
+        fpu_init_state(task->fpu_state);
+        task->fpu_used = true;
+    }
+
+    fpu_restore(task->fpu_state);
+    cpu->fpu_owner = task;
+    task->fpu_cpu = cpu->id + 1;
+}
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <string.h>
+#include <gdt.h>
+
+// Our own GDT and TSS, replacing Limine's. The TSS is what gives us a known
+// good stack for double faults, so a kernel stack overflow (running into the
+// guard page) ends in a panic message instead of a triple fault, and the
+// stack interrupts switch to when they come in from ring 3.
+
+#define GDT_CODE64      0x00AF9A000000FFFFull // Present, ring 0, code, long mode
+#define GDT_DATA        0x00CF92000000FFFFull // Present, ring 0, data, writable
+#define GDT_USER_CODE64 0x00AFFA000000FFFFull // Same, ring 3
+#define GDT_USER_DATA   0x00CFF2000000FFFFull
+#define GDT_TSS64       0x89ull               // Present, available 64-bit TSS
+
+struct gdt_ptr {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+void init_gdt(struct gdt *gdt) {
+    memset(gdt, 0, sizeof(struct gdt));
+
+    // 1. Segments
+    gdt->entries[GDT_KERNEL_CS / 8] = GDT_CODE64;
+    gdt->entries[GDT_KERNEL_DS / 8] = GDT_DATA;
+    gdt->entries[GDT_USER_DS / 8] = GDT_USER_DATA;
+    gdt->entries[GDT_USER_CS / 8] = GDT_USER_CODE64;
+
+    // 2. The TSS descriptor is 16 bytes, with the base scattered around
+    uint64_t base = (uint64_t)&gdt->tss;
+    uint64_t limit = sizeof(struct tss) - 1;
+    gdt->entries[GDT_TSS / 8] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) | (GDT_TSS64 << 40) |
+                                (((limit >> 16) & 0xF) << 48) | (((base >> 24) & 0xFF) << 56);
+    gdt->entries[GDT_TSS / 8 + 1] = base >> 32;
+
+    gdt->tss.ist[IST_DOUBLE_FAULT - 1] = ((uint64_t)gdt->ist_stack + IST_STACK_SIZE) & -16ull;
+    gdt->tss.iomap_base = sizeof(struct tss); // No I/O bitmap
+
+    // 3. Load it. CS can only be reloaded with a far return, the data
+    //    segments get the same selector as before. FS and GS are left alone,
+    //    loading them would clear the GS base on some CPUs.
+    struct gdt_ptr gdtr = { sizeof(gdt->entries) - 1, (uint64_t)gdt->entries };
+    asm volatile (
+        "lgdt %0\n"
+        "pushq %1\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "mov %2, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%ss\n"
+        "mov %3, %%ax\n"
+        "ltr %%ax\n"
+        : : "m"(gdtr), "i"(GDT_KERNEL_CS), "i"(GDT_KERNEL_DS), "i"(GDT_TSS) : "rax", "memory"
+    );
+}
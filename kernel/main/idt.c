@@ -1,94 +1,175 @@
 #include <idt.h>
+#include <gdt.h>
 #include <terminal.h>
 #include <panic.h>
 #include <halt.h>
+#include <cpu.h>
+#include <task.h>
+#include <errno.h>
 
 __attribute__((aligned(0x10))) 
 static struct idt_entry idt[256];
 static struct idt_ptr idtr;
 
 // Your existing exception handlers
-extern void isr13(void);
+extern void isr_nm(void);
 extern void isr14(void);
+extern void (*const exception_stubs[32])(void);
 // Your new Timer/Multitasking handler
-extern void isr32(void);
-
-// This is where we'll switch tasks later
-extern uint64_t schedule(uint64_t current_rsp);
+extern void isr_timer(void);
+extern void isr_resched(void);
+extern void isr_resched_ipi(void);
+extern void isr_spurious(void);
 
 __asm__(
     ".align 8\n"
 
-    // --- EXCEPTIONS (Vectors 13, 14) ---
-    "isr13: pushq $0; pushq $13; jmp isr_common\n"
-    "isr14:            pushq $14; jmp isr_common\n"
+    // Save/restore all 15 GPRs of the interrupted code
+    ".macro PUSH_GPRS\n"
+    "    push %rax; push %rbx; push %rcx; push %rdx\n"
+    "    push %rsi; push %rdi; push %rbp; push %r8\n"
+    "    push %r9;  push %r10; push %r11; push %r12\n"
+    "    push %r13; push %r14; push %r15\n"
+    ".endm\n"
+    ".macro POP_GPRS\n"
+    "    pop %r15; pop %r14; pop %r13; pop %r12\n"
+    "    pop %r11; pop %r10; pop %r9;  pop %r8\n"
+    "    pop %rbp; pop %rdi; pop %rsi; pop %rdx\n"
+    "    pop %rcx; pop %rbx; pop %rax\n"
+    ".endm\n"
+
+    // Coming from or going back to ring 3 (the CS the CPU pushed, at
+    // offset cs), switch between the program's GS base and struct cpu's.
+    // Interrupts have to be off between that and the iretq.
+    ".macro SWAPGS_IF_USER cs\n"
+    "    testb $3, \\cs(%rsp)\n"
+    "    jz 1f\n"
+    "    swapgs\n"
+    "1:\n"
+    ".endm\n"
+
+    // Interrupt that calls a C function with the interrupted code's
+    // registers saved. Task switches happen inside it (context_switch), so
+    // this stays the same whether we switch or not.
+    ".macro IRQ_STUB name, func\n"
+    ".global \\name\n"
+    "\\name:\n"
+    "    /* CPU already pushed SS, RSP, RFLAGS, CS, RIP */\n"
+    "    SWAPGS_IF_USER 8\n"
+    "    PUSH_GPRS\n"
+    "    mov %rsp, %rbx\n"
+    "    and $-16, %rsp\n"
+    "    call \\func\n"
+    "    mov %rbx, %rsp\n"
+    "    POP_GPRS\n"
+    "    cli\n"
+    "    SWAPGS_IF_USER 8\n"
+    "    iretq\n"
+    ".endm\n"
+
+    // --- EXCEPTIONS (all of 0-31, #NM and #PF get replaced below) ---
+    // Each stub makes the frame look the same: vector, error code (0 where
+    // the CPU pushes none), then what the CPU pushed.
+    ".macro EXC_STUB vec\n"
+    "exc\\vec: pushq $0; pushq $\\vec; jmp isr_common\n"
+    ".endm\n"
+    ".macro EXC_STUB_ERR vec\n"
+    "exc\\vec: pushq $\\vec; jmp isr_common\n"
+    ".endm\n"
+    "EXC_STUB 0;  EXC_STUB 1;  EXC_STUB 2;  EXC_STUB 3\n"
+    "EXC_STUB 4;  EXC_STUB 5;  EXC_STUB 6;  EXC_STUB 7\n"
+    "EXC_STUB_ERR 8;  EXC_STUB 9;  EXC_STUB_ERR 10; EXC_STUB_ERR 11\n"
+    "EXC_STUB_ERR 12; EXC_STUB_ERR 13; EXC_STUB_ERR 14; EXC_STUB 15\n"
+    "EXC_STUB 16; EXC_STUB_ERR 17; EXC_STUB 18; EXC_STUB 19\n"
+    "EXC_STUB 20; EXC_STUB_ERR 21; EXC_STUB 22; EXC_STUB 23\n"
+    "EXC_STUB 24; EXC_STUB 25; EXC_STUB 26; EXC_STUB 27\n"
+    "EXC_STUB 28; EXC_STUB_ERR 29; EXC_STUB_ERR 30; EXC_STUB 31\n"
 
     "isr_common:\n"
-    "    push %rdi; push %rsi; push %rdx; push %rcx\n"
-    "    push %r8;  push %r9;  push %r10; push %r11\n"
-    "    mov 64(%rsp), %rdi\n"   // vector
-    "    mov 80(%rsp), %rsi\n"   // RIP
-    "    mov 104(%rsp), %rdx\n"  // RSP
-    "    call exception_panic\n"
-
-    // --- TIMER IRQ (Vector 32) ---
-    ".global isr32\n"
-    "isr32:\n"
-    "    /* CPU already pushed RIP, CS, RFLAGS */\n"
-
-    "    //pushq $32\n"
-    "    //pushq $0\n"
-
-    "    push %rax\n"
-    "    push %rbx\n"
-    "    push %rcx\n"
-    "    push %rdx\n"
-    "    push %rsi\n"
-    "    push %rdi\n"
-    "    push %rbp\n"
-    "    push %r8\n"
-    "    push %r9\n"
-    "    push %r10\n"
-    "    push %r11\n"
-    "    push %r12\n"
-    "    push %r13\n"
-    "    push %r14\n"
-    "    push %r15\n"
-
-    "    mov %rsp, %rdi\n"
-    "    mov %rsp, %r12\n"
+    "    SWAPGS_IF_USER 24\n"
+    "    PUSH_GPRS\n"
+    "    mov 120(%rsp), %rdi\n"  // Vector
+    "    mov 128(%rsp), %rsi\n"  // Error code
+    "    mov 136(%rsp), %rdx\n"  // RIP
+    "    mov 144(%rsp), %rcx\n"  // CS
+    "    mov 160(%rsp), %r8\n"   // RSP
+    "    mov %rsp, %rbx\n"
+    "    and $-16, %rsp\n"
+    "    call exception\n"
+    "    mov %rbx, %rsp\n"
+    "    POP_GPRS\n"
+    "    add $16, %rsp\n"        // Drop the vector and error code
+    "    cli\n"
+    "    SWAPGS_IF_USER 8\n"
+    "    iretq\n"
+
+    ".pushsection .rodata\n"
+    ".align 8\n"
+    "exception_stubs:\n"
+    "    .irp vec, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31\n"
+    "    .quad exc\\vec\n"
+    "    .endr\n"
+    ".popsection\n"
+
+    // --- PAGE FAULT (#PF): demand paging, see vma.c ---
+    // The CPU pushed an error code on top of the usual frame
+    ".global isr14\n"
+    "isr14:\n"
+    "    SWAPGS_IF_USER 16\n"
+    "    PUSH_GPRS\n"
+    "    mov 120(%rsp), %rdi\n"  // Error code
+    "    lea 128(%rsp), %rsi\n"  // &RIP, uaccess_fixup() may move it
+    "    mov 152(%rsp), %rdx\n"  // RSP
+    "    mov 144(%rsp), %rcx\n"  // RFLAGS
+    "    mov %rsp, %rbx\n"
     "    and $-16, %rsp\n"
-    "    call schedule\n"
-    "    mov %rax, %rsp\n"
-
-    "    movb $0x20, %al\n"
-    "    outb %al, $0x20\n"
-
-    "    pop %r15\n"
-    "    pop %r14\n"
-    "    pop %r13\n"
-    "    pop %r12\n"
-    "    pop %r11\n"
-    "    pop %r10\n"
-    "    pop %r9\n"
-    "    pop %r8\n"
-    "    pop %rbp\n"
-    "    pop %rdi\n"
-    "    pop %rsi\n"
-    "    pop %rdx\n"
-    "    pop %rcx\n"
-    "    pop %rbx\n"
-    "    pop %rax\n"
-
-    "    //add $16, %rsp\n"        // pop error + vector
+    "    call page_fault\n"
+    "    mov %rbx, %rsp\n"
+    "    POP_GPRS\n"
+    "    add $8, %rsp\n"         // Drop the error code
+    "    cli\n"
+    "    SWAPGS_IF_USER 8\n"
+    "    iretq\n"
+
+    // --- DEVICE NOT AVAILABLE (#NM): a task's first FPU use since its switch ---
+    "IRQ_STUB isr_nm, fpu_trap\n"
+
+    // --- TIMER (PIT on vector 32, or the LAPIC timer) ---
+    // timer_interrupt sends the EOI first: if we switch away, we don't come
+    // back here for a while.
+    "IRQ_STUB isr_timer, timer_interrupt\n"
+
+    // --- RESCHEDULE (software, int $RESCHED_VECTOR) ---
+    // Same as the timer minus the tick and the EOI
+    "IRQ_STUB isr_resched, sched_resched_irq\n"
+
+    // --- RESCHEDULE IPI (from another CPU) ---
+    "IRQ_STUB isr_resched_ipi, sched_ipi\n"
+
+    // --- LAPIC SPURIOUS: no EOI, nothing to do ---
+    ".global isr_spurious\n"
+    "isr_spurious:\n"
     "    iretq\n"
 );
 
 
+// A CPU exception other than #NM and #PF. One a program caused kills the
+// program, and only the kernel's own are fatal. NMIs, machine checks and
+// double faults are the hardware's or the kernel's problem wherever they hit.
+void exception(uint64_t vector, uint64_t error, uint64_t rip, uint64_t cs, uint64_t rsp) {
+    if ((cs & 3) && vector != 2 && vector != 8 && vector != 18) {
+        asm volatile("sti"); // A program always runs with interrupts on
+        tcb_t *task = current_task;
+        printf("Task %u: exception %U (error %lx) at %p, killed\n", task->tid, vector, error, rip);
+        task_exit(-EFAULT);
+    }
+    exception_panic(vector, rip, rsp);
+}
+
 void idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags) {
     struct idt_entry* descriptor = &idt[vector];
     descriptor->isr_low    = (uint64_t)isr & 0xFFFF;
-    descriptor->kernel_cs  = 0x28; // Limine 64-bit CS
+    descriptor->kernel_cs  = GDT_KERNEL_CS;
     descriptor->ist        = 0;
     descriptor->attributes = flags;
     descriptor->isr_mid    = ((uint64_t)isr >> 16) & 0xFFFF;
@@ -96,16 +177,39 @@ void idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags) {
     descriptor->reserved   = 0;
 }
 
+// Run the handler on interrupt stack `ist` of the TSS (see gdt.h)
+void idt_set_ist(uint8_t vector, uint8_t ist) {
+    idt[vector].ist = ist;
+}
+
+// The IDT is the same on every CPU, the APs just load it
+void load_idt(void) {
+    asm volatile("lidt %0" : : "m"(idtr));
+}
+
 void init_idt() {
     idtr.base = (uint64_t)&idt[0];
     idtr.limit = (uint16_t)sizeof(struct idt_entry) * 256 - 1;
 
-    // Exceptions (Panic)
-    idt_set_descriptor(13, isr13, 0x8E);
+    // Exceptions: a program's kill it, the kernel's panic. A double fault is
+    // usually a blown kernel stack, so it gets a stack of its own.
+    for (int vector = 0; vector < 32; vector++) {
+        idt_set_descriptor(vector, exception_stubs[vector], 0x8E);
+    }
+    idt_set_ist(8, IST_DOUBLE_FAULT);
+
+    // Page faults bring in programs' memory
     idt_set_descriptor(14, isr14, 0x8E);
 
+    // Lazy FPU switching
+    idt_set_descriptor(7, isr_nm, 0x8E);
+
     // Hardware Interrupt (Timer - Multitasking)
-    idt_set_descriptor(32, isr32, 0x8E);
+    idt_set_descriptor(32, isr_timer, 0x8E);
+    idt_set_descriptor(TIMER_VECTOR, isr_timer, 0x8E);
+    idt_set_descriptor(RESCHED_VECTOR, isr_resched, 0x8E);
+    idt_set_descriptor(RESCHED_IPI_VECTOR, isr_resched_ipi, 0x8E);
+    idt_set_descriptor(SPURIOUS_VECTOR, isr_spurious, 0x8E);
 
-    asm volatile("lidt %0" : : "m"(idtr));
+    load_idt();
 }
\ No newline at end of file
@@ -29,4 +29,16 @@ __attribute__((used, section(".limine_requests")))
 volatile struct limine_executable_file_request cmdline_req = {
     .id = LIMINE_EXECUTABLE_FILE_REQUEST_ID,
     .revision = 0
-};
\ No newline at end of file
+};
+__attribute__((used, section(".limine_requests")))
+volatile struct limine_date_at_boot_request date_req = {
+    .id = LIMINE_DATE_AT_BOOT_REQUEST_ID,
+    .revision = 0
+};
+
+__attribute__((used, section(".limine_requests")))
+volatile struct limine_mp_request mp_req = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .flags = 0
+};
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <terminal.h>
+#include <spinlock.h>
+
+// Lock contention statistics (LOCK_STAT=1). The counters live in the locks
+// themselves, this just keeps a list of the named ones to print.
+
+#ifdef CONFIG_LOCK_STAT
+static struct lock_stat *stat_list = NULL;
+static spinlock_t stat_list_lock = SPINLOCK_INIT;
+
+void lock_stat_register(struct lock_stat *stat, const char *name) {
+    uint64_t flags = spin_lock_irqsave(&stat_list_lock);
+    if (stat->name == NULL) { // Once is enough
+        stat->name = name;
+        stat->next = stat_list;
+        stat_list = stat;
+    }
+    spin_unlock_irqrestore(&stat_list_lock, flags);
+}
+
+// One line per named lock that was ever taken
+void lock_stat_dump(void) {
+    printf("lock              acquired  contended  avg wait (cycles)\n");
+
+    uint64_t flags = spin_lock_irqsave(&stat_list_lock);
+    for (struct lock_stat *stat = stat_list; stat; stat = stat->next) {
+        if (stat->acquired == 0) continue;
+        uint64_t avg = stat->contended ? stat->wait_cycles / stat->contended : 0;
+        printf("%s", stat->name);
+        for (size_t len = strlen(stat->name); len < 16; len++) putc(' ');
+        printf(" %9U %10U %U\n", stat->acquired, stat->contended, avg);
+    }
+    spin_unlock_irqrestore(&stat_list_lock, flags);
+}
+#endif
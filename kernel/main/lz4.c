@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <lz4.h>
+
+// A small LZ4 frame decoder. Only what `lz4` on the host emits is supported:
+// a single frame, any block size, linked or independent blocks, optional
+// checksums (skipped, not verified) and an optional content size field.
+
+#define LZ4_FLG_BLOCK_CHECKSUM   0x10
+#define LZ4_FLG_CONTENT_SIZE     0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID          0x01
+#define LZ4_BLOCK_UNCOMPRESSED   0x80000000u
+#define LZ4_MIN_MATCH            4
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Copy in 8 byte words while we can, the kernel memcpy goes byte by byte.
+// Only safe when src is at least 8 bytes behind dst (or not overlapping at all).
+static inline void lz4_wild_copy(uint8_t *d, const uint8_t *s, size_t n) {
+    while (n >= 8) {
+        uint64_t v;
+        __builtin_memcpy(&v, s, 8);
+        __builtin_memcpy(d, &v, 8);
+        d += 8; s += 8; n -= 8;
+    }
+    while (n--) *d++ = *s++;
+}
+
+// Read a length that continues with 255-bytes (used for literals and matches).
+static int lz4_read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return LZ4_ERR_FORMAT;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return LZ4_OK;
+}
+
+// Decode one compressed block, writing no further than oend. When out_start
+// is NULL nothing is written and only the decoded length is counted (used to
+// size the buffer).
+static int64_t lz4_block(const uint8_t *ip, size_t in_len, uint8_t *out_start, uint8_t *op, uint8_t *oend) {
+    const uint8_t *iend = ip + in_len;
+    int64_t written = 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        // 1. Literals
+        size_t lit = token >> 4;
+        if (lit == 15 && lz4_read_length(&ip, iend, &lit) != LZ4_OK) return LZ4_ERR_FORMAT;
+        if ((size_t)(iend - ip) < lit) return LZ4_ERR_FORMAT;
+        if (out_start) {
+            if ((size_t)(oend - op) < lit) return LZ4_ERR_FORMAT;
+            lz4_wild_copy(op, ip, lit);
+            op += lit;
+        }
+        ip += lit;
+        written += lit;
+
+        // The last sequence of a block has literals only
+        if (ip >= iend) break;
+
+        // 2. Match
+        if (iend - ip < 2) return LZ4_ERR_FORMAT;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        size_t len = token & 15;
+        if (len == 15 && lz4_read_length(&ip, iend, &len) != LZ4_OK) return LZ4_ERR_FORMAT;
+        len += LZ4_MIN_MATCH;
+
+        if (out_start) {
+            if (offset == 0 || offset > (size_t)(op - out_start)) return LZ4_ERR_FORMAT;
+            if ((size_t)(oend - op) < len) return LZ4_ERR_FORMAT;
+            uint8_t *match = op - offset;
+            if (offset >= 8) {
+                lz4_wild_copy(op, match, len);
+                op += len;
+            } else {
+                // Overlapping copy (e.g. runs), must go byte by byte
+                for (size_t i = 0; i < len; i++) *op++ = *match++;
+            }
+        }
+        written += len;
+    }
+    return written;
+}
+
+// Walk the whole frame into dst[dst_size]. dst == NULL only counts the
+// decoded size.
+static int64_t lz4_frame(const uint8_t *in, size_t src_size, uint8_t *dst, size_t dst_size) {
+    const uint8_t *iend = in + src_size;
+
+    // 1. Frame header
+    if (src_size < 7 || lz4_read32(in) != LZ4_FRAME_MAGIC) return LZ4_ERR_FORMAT;
+    uint8_t flg = in[4];
+    if ((flg >> 6) != 1) return LZ4_ERR_FORMAT; // Version must be 01
+
+    const uint8_t *ip = in + 6; // Magic + FLG + BD
+    if (flg & LZ4_FLG_CONTENT_SIZE) ip += 8;
+    if (flg & LZ4_FLG_DICT_ID) return LZ4_ERR_FORMAT; // We have no dictionaries
+    ip += 1; // Header checksum
+
+    // 2. Data blocks, terminated by a zero EndMark
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_size;
+    int64_t total = 0;
+    while (1) {
+        if (iend - ip < 4) return LZ4_ERR_FORMAT;
+        uint32_t block_size = lz4_read32(ip);
+        ip += 4;
+        if (block_size == 0) break;
+
+        uint32_t len = block_size & ~LZ4_BLOCK_UNCOMPRESSED;
+        if ((size_t)(iend - ip) < len) return LZ4_ERR_FORMAT;
+
+        int64_t n;
+        if (block_size & LZ4_BLOCK_UNCOMPRESSED) {
+            if (dst) {
+                if ((size_t)(oend - op) < len) return LZ4_ERR_FORMAT;
+                lz4_wild_copy(op, ip, len);
+            }
+            n = len;
+        } else {
+            // Linked blocks may reference earlier blocks, which is fine since
+            // everything is decoded into one contiguous buffer.
+            n = lz4_block(ip, len, dst, op, oend);
+            if (n < 0) return n;
+        }
+        if (dst) op += n;
+        total += n;
+        ip += len;
+
+        if (flg & LZ4_FLG_BLOCK_CHECKSUM) ip += 4;
+    }
+    return total;
+}
+
+// --- Public Wrappers ---
+
+/*
+ * lz4_content_size
+ * * Returns the decompressed size of the frame, read from the header when
+ * * the frame was made with --content-size, otherwise by walking the blocks.
+ */
+int64_t lz4_content_size(const void *src, size_t src_size) {
+    const uint8_t *in = (const uint8_t *)src;
+    if (src_size < 15 || lz4_read32(in) != LZ4_FRAME_MAGIC) return LZ4_ERR_FORMAT;
+
+    if (in[4] & LZ4_FLG_CONTENT_SIZE) {
+        return (int64_t)((uint64_t)lz4_read32(in + 6) | ((uint64_t)lz4_read32(in + 10) << 32));
+    }
+    return lz4_frame(in, src_size, NULL, 0);
+}
+
+/*
+ * unlz4
+ * * src: pointer to LZ4 frame data
+ * * dst: pointer to destination buffer, dst_size bytes
+ * * Returns: Number of bytes written to dst, -1 if the frame is corrupt or
+ * * decodes to more than dst_size
+ */
+int64_t unlz4(const void *src, size_t src_size, void *dst, size_t dst_size) {
+    return lz4_frame((const uint8_t *)src, src_size, (uint8_t *)dst, dst_size);
+}
@@ -6,6 +6,7 @@ void panic(const char *reason) {
 	uint64_t rip = (uint64_t)__builtin_return_address(0);
 	uint64_t rsp;
         asm volatile("mov %%rsp, %0" : "=r"(rsp));
+	console_panic();
 	printf("\nKernel panic: %s\n", reason);
 	printf("\nRegisters:\n");
 	printf(" RIP: 0x%llX\n", rip);
@@ -13,10 +14,22 @@ void panic(const char *reason) {
 	halt();
 }
 
+static const char *exception_names[32] = {
+	[0] = "Divide error", [1] = "Debug exception", [2] = "Non-maskable interrupt",
+	[3] = "Breakpoint", [4] = "Overflow", [5] = "BOUND range exceeded",
+	[6] = "Invalid opcode", [7] = "Device not available", [10] = "Invalid TSS",
+	[11] = "Segment not present", [12] = "Stack fault", [16] = "x87 FPU error",
+	[17] = "Alignment check", [18] = "Machine check", [19] = "SIMD exception",
+	[20] = "Virtualization exception", [21] = "Control protection exception",
+};
+
 void exception_panic(uint64_t vector, uint64_t rip, uint64_t rsp) {
+	console_panic();
 	printf("\nKernel panic: ");
-	if (vector == 13) printf("A general protection fault occurred.\n");
+	if (vector == 8) printf("A double fault occurred (kernel stack overflow?).\n");
+	else if (vector == 13) printf("A general protection fault occurred.\n");
 	else if (vector == 14) printf("A page fault occurred.\n");
+	else if (vector < 32 && exception_names[vector]) printf("%s (exception %U).\n", exception_names[vector], vector);
 	else printf("An unknown exception occurred.\n");
 	printf("\nRegisters:\n");
 	printf(" RIP: 0x%llX\n", rip);
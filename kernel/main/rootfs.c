@@ -5,12 +5,24 @@
 #include <rootfs.h>
 #include <string.h>
 #include <gzip.h>
+#include <lz4.h>
+#include <cpu.h>
 #include <mm.h>
+#include <vfs.h>
 
 extern volatile struct limine_memmap_request mm_req;
 extern volatile struct limine_module_request mod_req;
 static uint8_t *tar_archive_start = NULL;
 
+// Index over the archive, built once by init_rootfs
+static struct rootfs_entry *index_entries = NULL; // In archive order
+static uint32_t index_count = 0;
+static uint32_t *index_buckets = NULL;            // Entry number + 1, 0 = empty
+static uint32_t index_mask = 0;
+
+// prefix + '/' + name + NUL
+#define TAR_NAME_MAX (155 + 1 + 100 + 1)
+
 // Helper: Convert Octal ASCII string to integer
 static uint64_t parse_octal(const char *str) {
     uint64_t val = 0;
@@ -21,34 +33,215 @@ static uint64_t parse_octal(const char *str) {
     return val;
 }
 
-static void parse_tar(uint8_t *ptr) {
-    while (1) {
+// Turn "./a//b/./c/" or "/a/x/../b/c" into "a/b/c" (the archive root is "").
+// Returns the length, or -1 if it doesn't fit.
+static int rootfs_normalise(const char *path, char *out, size_t out_size) {
+    size_t len = 0;
+
+    while (*path) {
+        // 1. Grab the next component
+        while (*path == '/') path++;
+        const char *comp = path;
+        while (*path && *path != '/') path++;
+        size_t comp_len = path - comp;
+
+        // 2. Skip empty and "." components, ".." drops the last one
+        if (comp_len == 0 || (comp_len == 1 && comp[0] == '.')) continue;
+        if (comp_len == 2 && comp[0] == '.' && comp[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;
+            continue;
+        }
+
+        // 3. Append it
+        if (len + (len > 0) + comp_len + 1 > out_size) return -1;
+        if (len > 0) out[len++] = '/';
+        memcpy(out + len, comp, comp_len);
+        len += comp_len;
+    }
+    out[len] = '\0';
+    return (int)len;
+}
+
+// FNV-1a, plenty for path names
+static uint32_t rootfs_hash(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The tar header keeps long paths split in prefix + name, neither NUL
+// terminated when full. Glue them back together.
+static void tar_full_name(const struct tar_header *h, char *out) {
+    size_t len = 0;
+    if (h->prefix[0]) {
+        while (len < sizeof(h->prefix) && h->prefix[len]) {
+            out[len] = h->prefix[len];
+            len++;
+        }
+        out[len++] = '/';
+    }
+    for (size_t i = 0; i < sizeof(h->name) && h->name[i]; i++) out[len++] = h->name[i];
+    out[len] = '\0';
+}
+
+static struct rootfs_entry *lookup_entry(const char *path, uint32_t hash) {
+    for (uint32_t slot = hash & index_mask; index_buckets[slot]; slot = (slot + 1) & index_mask) {
+        struct rootfs_entry *e = &index_entries[index_buckets[slot] - 1];
+        if (e->hash == hash && strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+// Walk the archive ONCE and build the path -> entry hash table that every
+// later read_rootfs() goes through.
+static void build_index(uint8_t *archive) {
+    char name[TAR_NAME_MAX];
+
+    // 1. First pass: count entries and name bytes so everything fits in
+    // three allocations, no matter how many files there are
+    uint32_t count = 0;
+    size_t name_bytes = 0;
+    for (uint8_t *ptr = archive; ((struct tar_header *)ptr)->name[0] != '\0';) {
         struct tar_header *h = (struct tar_header *)ptr;
-        if (h->name[0] == '\0') break; // End of archive
+        tar_full_name(h, name);
+        name_bytes += strlen(name) + 1;
+        count++;
+        ptr += 512 + ((parse_octal(h->size) + 511) & ~511);
+    }
+
+    // 2. Open addressing, at most half full so probe chains stay short
+    uint32_t buckets = 16;
+    while (buckets < count * 2) buckets <<= 1;
 
+    index_entries = malloc(count * sizeof(struct rootfs_entry) + 1);
+    index_buckets = malloc(buckets * sizeof(uint32_t));
+    char *names = malloc(name_bytes + 1);
+    if (!index_entries || !index_buckets || !names) panic("Not enough memory to index rootfs.");
+    memset(index_buckets, 0, buckets * sizeof(uint32_t));
+    index_mask = buckets - 1;
+    index_count = 0;
+
+    // 3. Second pass: fill in the entries in archive order
+    for (uint8_t *ptr = archive; ((struct tar_header *)ptr)->name[0] != '\0';) {
+        struct tar_header *h = (struct tar_header *)ptr;
         uint64_t size = parse_octal(h->size);
-        printf("Found file: %s (size: %d)\n", h->name, size);
 
-        // ptr + 512 is where the ELF file data starts!
-        
+        tar_full_name(h, name);
+        int len = rootfs_normalise(name, names, ROOTFS_PATH_MAX);
+        if (len < 0) panic("Path in rootfs is too long.");
+
+        uint32_t hash = rootfs_hash(names);
+        struct rootfs_entry *e = lookup_entry(names, hash);
+        if (e == NULL) {
+            // New path: claim the next entry and a free bucket
+            e = &index_entries[index_count++];
+            uint32_t slot = hash & index_mask;
+            while (index_buckets[slot]) slot = (slot + 1) & index_mask;
+            index_buckets[slot] = index_count;
+        }
+        // (A path that shows up twice keeps the last copy, like tar does)
+        e->path = names;
+        e->hash = hash;
+        e->type = h->typeflag[0] ? h->typeflag[0] : ROOTFS_TYPE_FILE;
+        e->mode = (uint32_t)parse_octal(h->mode);
+        e->mtime = parse_octal(h->mtime);
+        e->data = ptr + 512; // Data starts after header
+        e->size = size;
+
+        names += len + 1;
         // Jump to next header: header (512) + file data (aligned to 512)
         ptr += 512 + ((size + 511) & ~511);
     }
 }
 
-void init_rootfs(void) {
-    // 1. Get the module from Limine
-    if (!mod_req.response || mod_req.response->module_count == 0) {
-        panic("No rootfs found.");
+// --- tarfs: the archive as seen through the VFS ---
+
+static struct vfs_fs tarfs;
+
+static int64_t tarfs_read(struct vfs_node *node, void *buf, uint64_t offset, uint64_t len) {
+    memcpy(buf, (uint8_t *)node->fs_data + offset, len);
+    return (int64_t)len;
+}
+
+// The archive never moves, so file data can be handed out directly
+static void *tarfs_data(struct vfs_node *node) {
+    return node->fs_data;
+}
+
+// Every indexed entry becomes a node. Directories missing from the archive
+// are made up on the way, so "a/b/c" works even without "a/" and "a/b/".
+static int tarfs_mount(struct vfs_node *mountpoint, void *source) {
+    (void)source; // The archive is already indexed
+    for (uint32_t i = 0; i < index_count; i++) {
+        struct rootfs_entry *e = &index_entries[i];
+
+        int type;
+        if (e->type == ROOTFS_TYPE_DIR) type = VFS_DIR;
+        else if (e->type == ROOTFS_TYPE_FILE) type = VFS_FILE;
+        else continue; // Links and devices aren't supported
+
+        struct vfs_node *node = e->path[0] ? vfs_create(mountpoint, e->path, type, &tarfs) : mountpoint;
+        if (node == NULL || node->type != type) {
+            printf("rootfs: skipping /%s\n", e->path);
+            continue;
+        }
+        node->mode = e->mode & 07777;
+        node->mtime = e->mtime;
+        if (type == VFS_FILE) {
+            node->size = e->size;
+            node->fs_data = e->data;
+        }
     }
-    struct limine_file *file = mod_req.response->modules[0];
-    
-    // 2. Peek at the Gzip footer to see the UNCOMPRESSED size
-    // Gzip stores the original size in the last 4 bytes of the file
-    uint8_t *footer_ptr = (uint8_t *)(file->address + file->size - 4);
-    uint32_t real_size = *(uint32_t *)footer_ptr;
+    return 0;
+}
 
-    // 3. DYNAMIC ALLOCATION: Use malloc instead of manual memory map searching
+static struct vfs_fs tarfs = {
+    .name = "tarfs",
+    .mount = tarfs_mount,
+    .read = tarfs_read,
+    .data = tarfs_data,
+};
+
+static const char *rootfs_format_name(int format) {
+    switch (format) {
+        case ROOTFS_FORMAT_GZIP: return "gzip";
+        case ROOTFS_FORMAT_LZ4:  return "lz4";
+        case ROOTFS_FORMAT_TAR:  return "tar";
+        default:                 return "unknown";
+    }
+}
+
+// Figure out what the module is by its magic bytes, not by its file name
+static int rootfs_detect_format(const uint8_t *data, uint64_t size) {
+    if (size >= 18 && data[0] == 0x1F && data[1] == 0x8B) return ROOTFS_FORMAT_GZIP;
+    if (size >= 15 && *(const uint32_t *)data == LZ4_FRAME_MAGIC) return ROOTFS_FORMAT_LZ4;
+    if (size >= 512 && memcmp(((const struct tar_header *)data)->magic, "ustar", 5) == 0) return ROOTFS_FORMAT_TAR;
+    return ROOTFS_FORMAT_UNKNOWN;
+}
+
+// Decompress a gzip or lz4 module into a fresh heap buffer
+static uint8_t *unpack_rootfs(struct limine_file *file, int format) {
+    uint8_t *data = (uint8_t *)file->address;
+
+    // 1. Work out the UNCOMPRESSED size
+    uint64_t real_size;
+    if (format == ROOTFS_FORMAT_GZIP) {
+        // Gzip stores the original size in the last 4 bytes of the file
+        real_size = *(uint32_t *)(data + file->size - 4);
+    } else if (format == ROOTFS_FORMAT_LZ4) {
+        // Either in the frame header (--content-size) or found by walking the blocks
+        int64_t size = lz4_content_size(data, file->size);
+        if (size < 0) panic("Corrupted lz4 rootfs.");
+        real_size = (uint64_t)size;
+    } else {
+        panic("Unknown rootfs format.");
+    }
+
+    // 2. DYNAMIC ALLOCATION: Use malloc instead of manual memory map searching
     // This handles any size and ensures the heap won't overwrite our files
     void *safe_buffer = malloc(real_size);
 
@@ -56,37 +249,101 @@ void init_rootfs(void) {
         panic("Not enough memory to extract rootfs.");
     }
 
-    // 4. Unzip into our new dynamic buffer
-    ungzip(file->address, safe_buffer);
+    // 3. Decompress into our new dynamic buffer, timing it so the formats
+    // can be compared (cycles vs compressed size) straight from the boot log
+    uint64_t start = rdtsc();
+    int64_t written;
+    if (format == ROOTFS_FORMAT_GZIP) written = ungzip(data, safe_buffer);
+    else written = unlz4(data, file->size, safe_buffer, real_size);
+    uint64_t cycles = rdtsc() - start;
+
+    if (written < 0) panic("Failed to decompress rootfs.");
+
+    printf("rootfs: %s, %U -> %U bytes, %U cycles (%U cycles/KiB)\n",
+           rootfs_format_name(format), file->size, real_size, cycles,
+           real_size ? (cycles * 1024) / real_size : 0);
+
+    return (uint8_t*)safe_buffer;
+}
+
+void init_rootfs(void) {
+    // 1. Get the module from Limine
+    if (!mod_req.response || mod_req.response->module_count == 0) {
+        panic("No rootfs found.");
+    }
+    struct limine_file *file = mod_req.response->modules[0];
+    uint8_t *data = (uint8_t *)file->address;
+
+    int format = rootfs_detect_format(data, file->size);
 
-    // 5. Save the pointer globally for read_rootfs
-    tar_archive_start = (uint8_t*)safe_buffer;
+    // 2. A plain ustar archive is used in place: Limine already loaded it
+    // into memory that nobody else will claim, so there's nothing to copy.
+    if (format == ROOTFS_FORMAT_TAR) {
+        printf("rootfs: tar, %U bytes used in place\n", file->size);
+        tar_archive_start = data;
+    } else {
+        tar_archive_start = unpack_rootfs(file, format);
+    }
+
+    // 3. Index it for read_rootfs and hang it off the VFS root
+    build_index(tar_archive_start);
+    if (vfs_mount("/", &tarfs, NULL) < 0) panic("Failed to mount rootfs.");
 }
 
 rootfs_file_t read_rootfs(const char *path) {
     rootfs_file_t result = { .data = NULL, .size = 0 };
+    char name[ROOTFS_PATH_MAX];
 
     if (tar_archive_start == NULL) return result;
 
-    uint8_t *ptr = tar_archive_start;
+    // "./test.bin", "/test.bin" and "test.bin" are all the same file
+    if (rootfs_normalise(path, name, sizeof(name)) < 0) return result;
 
-    while (1) {
-        struct tar_header *h = (struct tar_header *)ptr;
+    struct rootfs_entry *e = lookup_entry(name, rootfs_hash(name));
+    if (e == NULL) return result; // Not found
 
-        if (h->name[0] == '\0') break; 
+    result.data = e->data;
+    result.size = e->size;
+    return result;
+}
 
+#ifdef CONFIG_BENCH
+// The old way: strcmp the raw header names from the start of the archive
+// until one matches, no normalising.
+static void *read_rootfs_linear(const char *path) {
+    for (uint8_t *ptr = tar_archive_start; ((struct tar_header *)ptr)->name[0] != '\0';) {
+        struct tar_header *h = (struct tar_header *)ptr;
         uint64_t size = parse_octal(h->size);
+        if (strcmp(h->name, path) == 0) return ptr + 512;
+        ptr += 512 + ((size + 511) & ~511);
+    }
+    return NULL;
+}
 
-        // Check if this is the file we want
-        if (strcmp(h->name, path) == 0) {
-            result.data = (void *)(ptr + 512); // Data starts after header
-            result.size = size;                // Store the parsed size
-            return result;
-        }
+void bench_rootfs(void) {
+    // 1. Hash index: look up every path in the archive
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < index_count; i++) {
+        if (read_rootfs(index_entries[i].path).data != index_entries[i].data) panic("rootfs index lookup failed");
+    }
+    uint64_t indexed = rdtsc() - start;
 
-        // Jump to next header: 512 (header) + aligned data size
-        ptr += 512 + ((size + 511) & ~511);
+    // 2. Linear scan: only every 100th path, it's O(files) per lookup. It
+    //    looks for the name as the header spells it, and finds the first
+    //    copy of a path the archive has twice where the index has the last.
+    char name[sizeof(((struct tar_header *)0)->name) + 1];
+    uint32_t samples = 0, mismatches = 0;
+    start = rdtsc();
+    for (uint32_t i = 0; i < index_count; i += 100) {
+        struct tar_header *h = (struct tar_header *)((uint8_t *)index_entries[i].data - 512);
+        memcpy(name, h->name, sizeof(h->name));
+        name[sizeof(h->name)] = '\0';
+        if (read_rootfs_linear(name) != index_entries[i].data) mismatches++;
+        samples++;
     }
+    uint64_t linear = rdtsc() - start;
 
-    return result; // Not found
-}
\ No newline at end of file
+    printf("bench: rootfs lookup, %u entries: index %U cycles/lookup, linear %U cycles/lookup (%u of %u differ)\n",
+           index_count, index_count ? indexed / index_count : 0, samples ? linear / samples : 0, mismatches, samples);
+}
+#endif
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limine.h>
+#include <cpu.h>
+#include <idt.h>
+#include <mm.h>
+#include <panic.h>
+#include <terminal.h>
+#include <apic.h>
+#include <syscall.h>
+#include <clockevent.h>
+#include <fpu.h>
+#include <task.h>
+#include <percpu.h>
+
+// Per-CPU data and bringing up the application processors. Limine already
+// woke the APs up and parked them in long mode on our page tables, so all
+// there is to do is hand each one its struct cpu and an entry point.
+
+extern volatile struct limine_mp_request mp_req;
+
+struct cpu *cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+
+static struct cpu bsp_cpu;
+static volatile uint32_t aps_started = 0;
+
+// Our GDT and TSS, then point GS at the struct cpu
+static void setup_cpu(struct cpu *cpu) {
+    cpu->self = cpu;
+    init_gdt(&cpu->gdt);
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+// The BSP's part. Needs to happen before anything touches current_task.
+void init_percpu(void) {
+    bsp_cpu.id = 0;
+    cpus[0] = &bsp_cpu;
+    setup_cpu(&bsp_cpu);
+    bsp_cpu.online = true;
+}
+
+// Where the APs land, on a small stack from Limine, interrupts off
+static void ap_entry(struct limine_mp_info *info) {
+    struct cpu *cpu = (struct cpu *)info->extra_argument;
+
+    // 1. Same per-CPU setup the BSP got in kmain
+    setup_cpu(cpu);
+    load_idt();
+    init_lapic();
+    init_vmm_ap();
+    init_syscall();
+    init_fpu_ap();
+    init_clockevent_ap();
+
+    // 2. Report in and become this CPU's idle task
+    cpu->online = true;
+    __atomic_add_fetch(&aps_started, 1, __ATOMIC_RELEASE);
+    sched_start_ap();
+}
+
+void init_smp(void) {
+    bsp_cpu.lapic_id = lapic_id();
+
+    struct limine_mp_response *mp = mp_req.response;
+    if (mp == NULL) {
+        printf("SMP: no MP response, running on the BSP only\n");
+        return;
+    }
+
+    // 1. A struct cpu for every AP, then let it go
+    uint32_t expected = 0;
+    for (uint64_t i = 0; i < mp->cpu_count; i++) {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) continue;
+        if (cpu_count == MAX_CPUS) break;
+
+        struct cpu *cpu = malloc(sizeof(struct cpu));
+        if (cpu == NULL) panic("Not enough memory for the CPUs.");
+        memset(cpu, 0, sizeof(struct cpu));
+        cpu->id = cpu_count;
+        cpu->lapic_id = info->lapic_id;
+        cpus[cpu_count++] = cpu;
+        expected++;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+    }
+
+    // 2. Wait until they're all taking tasks
+    while (__atomic_load_n(&aps_started, __ATOMIC_ACQUIRE) < expected) cpu_relax();
+    printf("SMP: %u CPUs online\n", cpu_count);
+}
@@ -1,46 +1,298 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <terminal.h>
+#include <task.h>
+#include <clock.h>
 #include <mm.h>
 
 // A simple memory management system.
+//
+// The block list is shared by every CPU and interrupt handler, so all of it
+// happens under heap_lock. Walking the list can take a while, so it's an MCS
+// lock: waiters spin on their own node instead of hammering the lock's line.
+//
+// Small allocations don't go near it most of the time. Every CPU keeps two
+// magazines (stacks of free objects) per size class and allocates from and
+// frees into those with just interrupts off: no lock, no shared cache line.
+// When a CPU runs dry or overflows, it trades whole magazines with a
+// per-class depot, and only the depot goes to the heap, a half magazine of
+// objects per lock hold.
+
+// Block states, in memory_header.is_free
+#define BLOCK_USED   0
+#define BLOCK_FREE   1
+#define BLOCK_CACHED 2 // Plus the size class: owned by the magazine layer
+
+#define MAG_SIZE       32  // Objects per magazine
+#define MAG_CLASSES    8   // 16, 32, ... 2048 bytes
+#define MAG_MIN_SHIFT  4
+#define MAG_MAX_SIZE   (1 << (MAG_MIN_SHIFT + MAG_CLASSES - 1))
+#define DEPOT_MAX_FULL 8   // Full magazines per class before we give some back
+
+struct magazine {
+    struct magazine *next;  // Depot lists
+    uint32_t count;
+    void *objs[MAG_SIZE];
+};
+
+// A CPU's magazines. The second one means a CPU going back and forth across
+// a magazine boundary swaps them instead of going to the depot each time.
+struct cpu_cache {
+    struct magazine *loaded[MAG_CLASSES];
+    struct magazine *prev[MAG_CLASSES];
+} __attribute__((aligned(64)));
+
+struct depot {
+    spinlock_t lock;
+    struct magazine *full;
+    struct magazine *empty;
+    uint32_t nr_full;
+} __attribute__((aligned(64)));
 
 struct memory_header *free_list_start = NULL;
 
+static mcs_lock_t heap_lock = MCS_LOCK_INIT;
+static percpu_counter_t heap_used;
+
+static struct cpu_cache caches[MAX_CPUS];
+static struct depot depots[MAG_CLASSES];
+static bool use_magazines = true;       // bench_malloc turns them off to compare
+
 void init_mm(void* start_addr, size_t total_size) {
+    mcs_lock_name(&heap_lock, "heap");
     free_list_start = (struct memory_header*)start_addr;
     free_list_start->size = total_size - sizeof(struct memory_header);
-    free_list_start->is_free = 1;
+    free_list_start->is_free = BLOCK_FREE;
     free_list_start->next = NULL;
-}
 
-void* malloc(size_t size) {
-    // 1. Alignment (8 or 16 byte alignment is crucial for modern CPUs)
-    size = (size + 7) & ~7; 
+    for (int i = 0; i < MAG_CLASSES; i++) {
+        spin_lock_init(&depots[i].lock);
+        spin_lock_name(&depots[i].lock, "depot");
+    }
+}
 
+// First fit. size is already rounded up. Call with heap_lock held.
+static struct memory_header *heap_alloc_locked(size_t size) {
     struct memory_header *curr = free_list_start;
     while (curr) {
-        if (curr->is_free && curr->size >= size) {
-            // Can we split this block? 
+        if (curr->is_free == BLOCK_FREE && curr->size >= size) {
+            // Can we split this block?
             // We need enough space for the requested size + a new header + at least some data
             if (curr->size >= (size + sizeof(struct memory_header) + 16)) {
                 struct memory_header *new_block = (struct memory_header*)((uint8_t*)(curr + 1) + size);
                 new_block->size = curr->size - size - sizeof(struct memory_header);
-                new_block->is_free = 1;
+                new_block->is_free = BLOCK_FREE;
                 new_block->next = curr->next;
 
                 curr->size = size;
                 curr->next = new_block;
             }
 
-            curr->is_free = 0;
-            return (void*)(curr + 1);
+            curr->is_free = BLOCK_USED;
+            percpu_counter_add(&heap_used, curr->size);
+            return curr;
         }
         curr = curr->next;
     }
     return NULL;
 }
 
+// Merge neighbouring free blocks. Call with heap_lock held.
+static void heap_coalesce_locked(void) {
+    struct memory_header *curr = free_list_start;
+    while (curr && curr->next) {
+        if (curr->is_free == BLOCK_FREE && curr->next->is_free == BLOCK_FREE) {
+            curr->size += sizeof(struct memory_header) + curr->next->size;
+            curr->next = curr->next->next;
+            // Don't move to next yet, check if the NEW next is also free
+            continue;
+        }
+        curr = curr->next;
+    }
+}
+
+static void *heap_alloc(size_t size) {
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    struct memory_header *block = heap_alloc_locked(size);
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+    return block ? (void*)(block + 1) : NULL;
+}
+
+static void heap_free(struct memory_header *header) {
+    percpu_counter_add(&heap_used, -(int64_t)header->size);
+
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    header->is_free = BLOCK_FREE;
+    heap_coalesce_locked();
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+}
+
+static inline int size_class(size_t size) {
+    if (size <= (1 << MAG_MIN_SHIFT)) return 0;
+    return 64 - __builtin_clzll(size - 1) - MAG_MIN_SHIFT;
+}
+
+// Half a magazine of fresh objects, for one trip to the heap
+static void heap_fill(struct magazine *mag, int cls) {
+    size_t size = (size_t)1 << (cls + MAG_MIN_SHIFT);
+
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    while (mag->count < MAG_SIZE / 2) {
+        struct memory_header *block = heap_alloc_locked(size);
+        if (block == NULL) break;
+        block->is_free = BLOCK_CACHED + cls;
+        mag->objs[mag->count++] = block + 1;
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+}
+
+// Give every object in a magazine back to the heap, for one trip
+static void heap_drain(struct magazine *mag) {
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    for (uint32_t i = 0; i < mag->count; i++) {
+        struct memory_header *header = (struct memory_header*)mag->objs[i] - 1;
+        percpu_counter_add(&heap_used, -(int64_t)header->size);
+        header->is_free = BLOCK_FREE;
+    }
+    heap_coalesce_locked();
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+    mag->count = 0;
+}
+
+// An empty magazine from the depot, or a new one
+static struct magazine *get_empty(struct depot *depot) {
+    spin_lock(&depot->lock);
+    struct magazine *mag = depot->empty;
+    if (mag) depot->empty = mag->next;
+    spin_unlock(&depot->lock);
+
+    if (mag == NULL) mag = heap_alloc(sizeof(struct magazine));
+    if (mag) mag->count = 0;
+    return mag;
+}
+
+// loaded is empty: find a magazine with objects in it. Interrupts off.
+static struct magazine *cache_refill(struct cpu_cache *cache, int cls) {
+    struct magazine *loaded = cache->loaded[cls];
+    struct magazine *prev = cache->prev[cls];
+    struct depot *depot = &depots[cls];
+
+    // 1. The other one still has some
+    if (prev && prev->count) {
+        cache->loaded[cls] = prev;
+        cache->prev[cls] = loaded;
+        return prev;
+    }
+
+    // 2. Trade an empty one for a full one at the depot
+    spin_lock(&depot->lock);
+    struct magazine *full = depot->full;
+    if (full) {
+        depot->full = full->next;
+        depot->nr_full--;
+        if (prev) {
+            prev->next = depot->empty;
+            depot->empty = prev;
+        }
+        cache->prev[cls] = loaded;
+        cache->loaded[cls] = full;
+    }
+    spin_unlock(&depot->lock);
+    if (full) return full;
+
+    // 3. Go to the heap ourselves
+    if (loaded == NULL) {
+        loaded = get_empty(depot);
+        if (loaded == NULL) return NULL;
+        cache->loaded[cls] = loaded;
+    }
+    heap_fill(loaded, cls);
+    return loaded->count ? loaded : NULL;
+}
+
+// loaded is full (or missing): find a magazine with room. Interrupts off.
+static struct magazine *cache_spill(struct cpu_cache *cache, int cls) {
+    struct magazine *loaded = cache->loaded[cls];
+    struct magazine *prev = cache->prev[cls];
+    struct depot *depot = &depots[cls];
+
+    // 1. The other one has room
+    if (prev && prev->count < MAG_SIZE) {
+        cache->loaded[cls] = prev;
+        cache->prev[cls] = loaded;
+        return prev;
+    }
+
+    // 2. Hand the full one to the depot, unless it has plenty already, in
+    //    which case its objects go back to the heap and we reuse it
+    struct magazine *empty = NULL;
+    if (prev) {
+        bool drain = false;
+        spin_lock(&depot->lock);
+        if (depot->nr_full < DEPOT_MAX_FULL) {
+            prev->next = depot->full;
+            depot->full = prev;
+            depot->nr_full++;
+        } else {
+            drain = true;
+        }
+        spin_unlock(&depot->lock);
+
+        if (drain) {
+            heap_drain(prev);
+            empty = prev;
+        }
+    }
+    if (empty == NULL) empty = get_empty(depot);
+
+    cache->prev[cls] = loaded;
+    cache->loaded[cls] = empty;
+    return empty;
+}
+
+static void *cache_alloc(int cls) {
+    uint64_t flags = irq_save();
+    struct cpu_cache *cache = &caches[this_cpu_id()];
+    struct magazine *mag = cache->loaded[cls];
+    if (mag == NULL || mag->count == 0) mag = cache_refill(cache, cls);
+    void *obj = mag ? mag->objs[--mag->count] : NULL;
+    irq_restore(flags);
+    return obj;
+}
+
+static void cache_free(void *obj, int cls) {
+    uint64_t flags = irq_save();
+    struct cpu_cache *cache = &caches[this_cpu_id()];
+    struct magazine *mag = cache->loaded[cls];
+    if (mag == NULL || mag->count == MAG_SIZE) mag = cache_spill(cache, cls);
+    if (mag) mag->objs[mag->count++] = obj;
+    irq_restore(flags);
+
+    // Couldn't even get a magazine, it goes straight back
+    if (mag == NULL) heap_free((struct memory_header*)obj - 1);
+}
+
+void* malloc(size_t size) {
+    // 1. Alignment (8 or 16 byte alignment is crucial for modern CPUs)
+    size = (size + 7) & ~7;
+
+    // 2. Small ones come from this CPU's magazines
+    if (size <= MAG_MAX_SIZE && use_magazines) {
+        void *obj = cache_alloc(size_class(size));
+        if (obj) return obj;
+    }
+    return heap_alloc(size);
+}
+
 void* realloc(void* ptr, size_t size) {
     if (!ptr) return malloc(size);
 
@@ -59,16 +311,46 @@ void free(void* ptr) {
     if (!ptr) return;
 
     struct memory_header *header = (struct memory_header*)ptr - 1;
-    header->is_free = 1;
+    if (header->is_free >= BLOCK_CACHED) cache_free(ptr, header->is_free - BLOCK_CACHED);
+    else heap_free(header);
+}
 
-    struct memory_header *curr = free_list_start;
-    while (curr && curr->next) {
-        if (curr->is_free && curr->next->is_free) {
-            curr->size += sizeof(struct memory_header) + curr->next->size;
-            curr->next = curr->next->next;
-            // Don't move to next yet, check if the NEW next is also free
-            continue; 
+// Bytes taken from the heap and not given back yet (objects sitting in the
+// magazines included)
+size_t heap_in_use(void) {
+    return percpu_counter_read(&heap_used);
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_MALLOC_ROUNDS 20000
+
+// Mixed small sizes, a few live at a time, like the kernel's own users
+static void bench_malloc_worker(void) {
+    void *live[4] = { NULL, NULL, NULL, NULL };
+    for (uint32_t i = 0; i < BENCH_MALLOC_ROUNDS; i++) {
+        uint32_t slot = i & 3;
+        free(live[slot]);
+        live[slot] = malloc(16 << (i % 7));
+    }
+    for (int i = 0; i < 4; i++) free(live[i]);
+}
+
+void bench_malloc(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        use_magazines = pass == 1;
+        printf("bench: malloc+free %s:", use_magazines ? "with magazines" : "heap only");
+
+        // Everyone does the same work, so per-CPU throughput should hold up
+        // as CPUs are added (1, 2, 4, ... up to all of them)
+        for (uint32_t ncpus = 1; ; ncpus *= 2) {
+            if (ncpus > cpu_count) ncpus = cpu_count;
+            uint64_t cycles = bench_on_cpus(bench_malloc_worker, ncpus);
+            uint64_t ops = (uint64_t)BENCH_MALLOC_ROUNDS * ncpus;
+            printf(" %u CPU %U kops/s", ncpus, ops * (tsc_hz / 1000) / (cycles ? cycles : 1));
+            if (ncpus == cpu_count) break;
         }
-        curr = curr->next;
+        printf("\n");
     }
-}
\ No newline at end of file
+    use_magazines = true;
+}
+#endif
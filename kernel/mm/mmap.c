@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <task.h>
+#include <vfs.h>
+#include <file.h>
+
+// mmap() of rootfs files. The archive is already in memory, so a mapping is
+// just new page table entries pointing at the pages it sits in, read-only:
+// nothing is copied. Archive members are only 512 byte aligned, so the
+// returned pointer is at the right spot inside the first page (and the
+// neighbouring bytes of the archive in those pages are visible too).
+//
+// A program's mappings are VMAs of its address space instead, and the
+// file's pages only get mapped as they're touched (see vma.c).
+
+static uint64_t mmap_next = MMAP_BASE;
+
+int64_t sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t offset) {
+    (void)addr;  // Hints are ignored, we pick the address
+    (void)flags; // Every mapping is shared and read-only
+
+    // 1. Check what's being asked for
+    if (len == 0) return -EINVAL;
+    if (prot & PROT_WRITE) return -EACCES;
+
+    struct vfs_node *node = fd_node(fd);
+    if (node == NULL) return -EBADF;
+    if (node->type != VFS_FILE) return -ENODEV;
+    if (offset >= node->size) return -EINVAL;
+    if (len > node->size - offset) len = node->size - offset;
+
+    // 2. A program's mapping starts on the page the offset is in
+    struct vm_space *space = current_task->space;
+    if (space) {
+        uint64_t first = offset & ~(uint64_t)(PAGE_SIZE - 1);
+        int64_t virt = vma_mmap(space, offset - first + len, prot, node, first);
+        return virt < 0 ? virt : virt + (int64_t)(offset - first);
+    }
+
+    uint8_t *data = vfs_data(node);
+    if (data == NULL) return -ENODEV; // Not resident, nothing to share
+
+    // 3. Work out which pages the range covers
+    uint64_t start = (uint64_t)(data + offset);
+    uint64_t first = start & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t pages = ((start + len + PAGE_SIZE - 1) - first) / PAGE_SIZE;
+    if (mmap_next + pages * PAGE_SIZE > MMAP_END) return -ENOMEM;
+
+    // 4. Point the new range at the same physical pages
+    uint64_t pml4 = vmm_current();
+    uint64_t pte_flags = PTE_USER | PTE_SHARED | ((prot & PROT_EXEC) ? 0 : vmm_nx());
+    uint64_t virt = mmap_next;
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t phys = vmm_translate(pml4, first + i * PAGE_SIZE);
+        if (phys == 0 || vmm_map(pml4, virt + i * PAGE_SIZE, phys, pte_flags) < 0) {
+            while (i--) vmm_unmap(pml4, virt + i * PAGE_SIZE);
+            return phys ? -ENOMEM : -EFAULT;
+        }
+    }
+
+    // Leave an unmapped page between mappings to catch overruns
+    mmap_next += (pages + 1) * PAGE_SIZE;
+    return (int64_t)(virt + (start - first));
+}
+
+int64_t sys_munmap(uint64_t addr, uint64_t len) {
+    if (addr < MMAP_BASE || addr >= MMAP_END || len == 0) return -EINVAL;
+
+    uint64_t first = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    struct vm_space *space = current_task->space;
+    if (space) return vma_munmap(space, first, (addr + len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+
+    // 1. The pages belong to the rootfs, so only the mapping goes away
+    uint64_t pml4 = vmm_current();
+    for (uint64_t page = first; page < addr + len; page += PAGE_SIZE) {
+        vmm_unmap(pml4, page);
+    }
+
+    // 2. Other CPUs may still have it in their TLBs
+    vmm_flush_lazy();
+    return 0;
+}
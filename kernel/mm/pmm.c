@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limine.h>
+#include <terminal.h>
+#include <spinlock.h>
+#include <panic.h>
+#include <pmm.h>
+
+// Physical page allocator. Free pages are chained through their own first
+// word (reached through the HHDM), so alloc and free are both O(1). One lock
+// covers the list, it's only held for a couple of loads and stores.
+//
+// Every page also has a reference count, for pages that several address
+// spaces share after a fork (see vmm_clone_space()): pmm_alloc() hands a
+// page out with one, pmm_ref() adds one, and pmm_free() only gives the page
+// back once the last one is dropped. The counts take 2 bytes per page of
+// RAM, carved out of the usable memory at boot.
+
+extern volatile struct limine_memmap_request mm_req;
+
+static uint64_t free_list = 0; // Physical address of the first free page
+static uint64_t free_count = 0;
+static uint64_t total_count = 0;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+static uint16_t *page_refs = NULL; // Indexed by page frame number
+
+static void push_page(uint64_t phys) {
+    *(uint64_t *)PHYS_TO_VIRT(phys) = free_list;
+    free_list = phys;
+    free_count++;
+}
+
+// Room for the reference counts in usable memory, outside the heap
+static uint64_t find_refs_space(uint64_t size, uint64_t heap_base, uint64_t heap_end) {
+    struct limine_memmap_response *memmap = mm_req.response;
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uint64_t base = (entry->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (entry->base + entry->length) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (base == 0) base = PAGE_SIZE;
+        if (base < heap_end && base + size > heap_base) base = heap_end;
+        if (base + size <= end) return base;
+    }
+    return 0;
+}
+
+void init_pmm(uint64_t heap_base, uint64_t heap_len) {
+    struct limine_memmap_response *memmap = mm_req.response;
+    uint64_t heap_end = heap_base + heap_len;
+    spin_lock_name(&pmm_lock, "pmm");
+
+    // 1. A reference count for every page up to the end of usable memory
+    uint64_t top = 0;
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->base + entry->length > top) top = entry->base + entry->length;
+    }
+    uint64_t refs_size = ((top / PAGE_SIZE) * sizeof(uint16_t) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t refs_base = find_refs_space(refs_size, heap_base, heap_end);
+    if (refs_base == 0) panic("No room for the page reference counts.");
+    page_refs = PHYS_TO_VIRT(refs_base);
+    memset(page_refs, 0, refs_size);
+
+    // 2. Everything else is free
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        // Hand out whole pages only, and never anything the heap owns
+        uint64_t base = (entry->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (entry->base + entry->length) & ~(uint64_t)(PAGE_SIZE - 1);
+        for (uint64_t page = base; page < end; page += PAGE_SIZE) {
+            if (page >= heap_base && page < heap_end) continue;
+            if (page >= refs_base && page < refs_base + refs_size) continue;
+            if (page == 0) continue; // 0 means "out of memory"
+            push_page(page);
+        }
+    }
+    total_count = free_count;
+    printf("pmm: %U pages (%U MiB) free\n", free_count, (free_count * PAGE_SIZE) >> 20);
+}
+
+// Returns a physical address, or 0 when out of memory
+uint64_t pmm_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t phys = free_list;
+    if (phys) {
+        free_list = *(uint64_t *)PHYS_TO_VIRT(phys);
+        free_count--;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    if (phys) page_refs[phys / PAGE_SIZE] = 1;
+    return phys;
+}
+
+uint64_t pmm_alloc_zeroed(void) {
+    uint64_t phys = pmm_alloc();
+    if (phys) memset(PHYS_TO_VIRT(phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+// Drop a reference to the page, freeing it with the last one
+void pmm_free(uint64_t phys) {
+    if (phys == 0) return;
+    if (__atomic_sub_fetch(&page_refs[phys / PAGE_SIZE], 1, __ATOMIC_ACQ_REL) != 0) return;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    push_page(phys);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// One more user of an allocated page
+void pmm_ref(uint64_t phys) {
+    __atomic_add_fetch(&page_refs[phys / PAGE_SIZE], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t pmm_refs(uint64_t phys) {
+    return __atomic_load_n(&page_refs[phys / PAGE_SIZE], __ATOMIC_ACQUIRE);
+}
+
+uint64_t pmm_free_pages(void) {
+    return free_count;
+}
+
+uint64_t pmm_total_pages(void) {
+    return total_count;
+}
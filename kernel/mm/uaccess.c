@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <uaccess.h>
+
+// The copies themselves. Every instruction that touches a program's memory
+// has an entry in __ex_table, (where it is, where to go instead). When one
+// faults on a page the program doesn't have, page_fault() finds the entry
+// and resumes at the fixup, which returns how far it got.
+//
+// __copy_user(dst, src, len) returns how many bytes it did NOT copy.
+// __strncpy_user(dst, src, max) returns the string's length, max if there
+// was no NUL in the first max bytes, or -EFAULT.
+
+struct ex_entry {
+    uint64_t insn;
+    uint64_t fixup;
+};
+
+extern const struct ex_entry __ex_table_start[], __ex_table_end[];
+extern uint64_t __copy_user(void *dst, const void *src, uint64_t len);
+extern int64_t __strncpy_user(char *dst, const char *src, uint64_t max);
+
+__asm__(
+    ".global __copy_user\n"
+    "__copy_user:\n"
+    "    mov %rdx, %rcx\n"
+    "1:  rep movsb\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+    "2:  mov %rcx, %rax\n"           // rep movsb stops with what's left in rcx
+    "    ret\n"
+
+    ".global __strncpy_user\n"
+    "__strncpy_user:\n"
+    "    xor %eax, %eax\n"
+    "3:  cmp %rdx, %rax\n"
+    "    je 5f\n"
+    "4:  movb (%rsi,%rax), %cl\n"
+    "    movb %cl, (%rdi,%rax)\n"
+    "    test %cl, %cl\n"
+    "    jz 5f\n"
+    "    inc %rax\n"
+    "    jmp 3b\n"
+    "5:  ret\n"
+    "6:  mov $-14, %rax\n"           // -EFAULT
+    "    ret\n"
+
+    ".pushsection __ex_table, \"a\"\n"
+    ".balign 8\n"
+    "    .quad 1b, 2b\n"
+    "    .quad 4b, 6b\n"
+    ".popsection\n"
+);
+
+_Static_assert(EFAULT == 14, "__strncpy_user returns -EFAULT by hand");
+
+int copy_from_user(void *dst, const void *src, uint64_t len) {
+    if (!access_ok(src, len)) return -EFAULT;
+    return __copy_user(dst, src, len) ? -EFAULT : 0;
+}
+
+int copy_to_user(void *dst, const void *src, uint64_t len) {
+    if (!access_ok(dst, len)) return -EFAULT;
+    return __copy_user(dst, src, len) ? -EFAULT : 0;
+}
+
+// Copy a NUL terminated string into dst[size]. Returns its length,
+// -ENAMETOOLONG if it doesn't fit, -EFAULT if it isn't all in the program's
+// memory.
+int64_t strncpy_from_user(char *dst, const char *src, uint64_t size) {
+    if (size == 0 || !access_ok(src, 1)) return -EFAULT;
+
+    // 1. Never read past the end of the user half, however long dst is
+    uint64_t max = USER_END - (uint64_t)src;
+    if (max > size) max = size;
+
+    // 2. Running into either limit without a NUL
+    int64_t len = __strncpy_user(dst, src, max);
+    if (len < 0) return len;
+    if ((uint64_t)len == max) return max == size ? -ENAMETOOLONG : -EFAULT;
+    return len;
+}
+
+// A kernel fault at *rip: if it's one of the copies above, point *rip at
+// the fixup and return true
+bool uaccess_fixup(uint64_t *rip) {
+    for (const struct ex_entry *e = __ex_table_start; e < __ex_table_end; e++) {
+        if (e->insn == *rip) {
+            *rip = e->fixup;
+            return true;
+        }
+    }
+    return false;
+}
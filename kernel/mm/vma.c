@@ -0,0 +1,399 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <cpu.h>
+#include <mm.h>
+#include <panic.h>
+#include <terminal.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <vfs.h>
+#include <task.h>
+#include <uaccess.h>
+
+// What's in a program's address space is a list of VMAs, and a page only
+// gets memory when it's first touched, through the page fault handler:
+// - zero-filled memory (heap, stack, .bss) reads as the shared zero page,
+//   and gets a page of its own on the first write
+// - a file's pages (ELF segments, mmap()) are the file's own pages from
+//   vfs_pages(). A writable mapping copies a page on its first write, and a
+//   page where the file stops partway gets a copy with the rest zeroed.
+// - after a fork (vmm_clone_space()), private pages are read-only and
+//   PTE_COW on both sides, and the first write copies them, unless nobody
+//   else holds the page by then
+// Only one task runs in a space, so the TLB entries other CPUs have for it
+// are flushed before they can be used again (see vmm_flush_space()), and a
+// page may be freed right after it's unmapped.
+
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+// Page fault error code bits
+#define FAULT_WRITE (1 << 1)
+#define FAULT_USER  (1 << 2) // In ring 3
+#define FAULT_RSVD  (1 << 3) // Reserved bit set in a paging entry
+#define FAULT_EXEC  (1 << 4) // Instruction fetch
+
+static uint64_t zero_page = 0;
+
+// The page all untouched zero-filled memory reads as
+static uint64_t get_zero_page(void) {
+    uint64_t phys = __atomic_load_n(&zero_page, __ATOMIC_ACQUIRE);
+    if (phys) return phys;
+    phys = pmm_alloc_zeroed();
+    if (phys == 0) return 0;
+
+    // Someone else may have beaten us to it
+    uint64_t expected = 0;
+    if (!__atomic_compare_exchange_n(&zero_page, &expected, phys, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pmm_free(phys);
+        return expected;
+    }
+    return phys;
+}
+
+static struct vma *find_vma(struct vm_space *space, uint64_t addr) {
+    for (struct vma *vma = space->vmas; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+// Does any VMA cover part of [start, end)?
+static bool overlaps(struct vm_space *space, uint64_t start, uint64_t end) {
+    for (struct vma *vma = space->vmas; vma && vma->start < end; vma = vma->next) {
+        if (vma->end > start) return true;
+    }
+    return false;
+}
+
+static int insert_vma(struct vm_space *space, uint64_t start, uint64_t end, uint32_t prot,
+                      struct vfs_node *node, uint64_t offset, uint64_t file_end) {
+    // The last user page stays unmapped, SYSRET relies on it (syscall_entry.S)
+    if (((start | end | offset) & PAGE_MASK) || start >= end || end > USER_END - PAGE_SIZE) return -EINVAL;
+    if (overlaps(space, start, end)) return -EEXIST;
+
+    struct vma *vma = malloc(sizeof(struct vma));
+    if (vma == NULL) return -ENOMEM;
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->node = node;
+    vma->offset = offset;
+    vma->file_end = file_end;
+
+    struct vma **link = &space->vmas;
+    while (*link && (*link)->start < start) link = &(*link)->next;
+    vma->next = *link;
+    *link = vma;
+    return 0;
+}
+
+static void remove_vma(struct vm_space *space, struct vma *vma) {
+    struct vma **link = &space->vmas;
+    while (*link != vma) link = &(*link)->next;
+    *link = vma->next;
+    free(vma);
+}
+
+// Take [start, end) out of the page tables, dropping the private pages
+static void unmap_range(struct vm_space *space, uint64_t start, uint64_t end) {
+    for (uint64_t page = start; page < end; page += PAGE_SIZE) {
+        uint64_t pte = vmm_entry(space->pml4, page);
+        if (!(pte & PTE_PRESENT)) continue;
+        vmm_unmap(space->pml4, page);
+        if (!(pte & PTE_SHARED)) pmm_free(pte & PTE_ADDR_MASK);
+    }
+    vmm_flush_space(space);
+}
+
+// Describe [start, end) of a space. For a file mapping, node's bytes from
+// offset on show up at start, up to file_end; past that it's zeroes.
+int vma_add(struct vm_space *space, uint64_t start, uint64_t end, uint32_t prot,
+            struct vfs_node *node, uint64_t offset, uint64_t file_end) {
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+    int err = insert_vma(space, start, end, prot, node, offset, file_end);
+    spin_unlock_irqrestore(&space->lock, flags);
+    return err;
+}
+
+// A write to a copy-on-write page: the last one holding a private page can
+// just have it, anyone else gets a copy.
+static int fault_cow(struct vm_space *space, uint64_t page, uint64_t pte, uint64_t flags) {
+    uint64_t old = pte & PTE_ADDR_MASK;
+    flags |= PTE_WRITE;
+    if (!(pte & PTE_SHARED) && pmm_refs(old) == 1) return vmm_map(space->pml4, page, old, flags);
+
+    uint64_t copy = pmm_alloc();
+    if (copy == 0) return -ENOMEM;
+    memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(old), PAGE_SIZE);
+    if (vmm_map(space->pml4, page, copy, flags) < 0) {
+        pmm_free(copy);
+        return -ENOMEM;
+    }
+    if (!(pte & PTE_SHARED)) pmm_free(old);
+    return 0;
+}
+
+// First touch of a page
+static int fault_fill(struct vm_space *space, struct vma *vma, uint64_t page, bool write, uint64_t flags) {
+    uint64_t cow = (vma->prot & PROT_WRITE) ? PTE_COW : 0;
+
+    // 1. Reading a page that's all file maps the file's own page, reading
+    //    zero-filled memory the zero page
+    uint8_t *src = NULL;
+    if (vma->node && page < vma->file_end) {
+        uint8_t *file = vfs_pages(vma->node);
+        if (file == NULL) return -ENOMEM;
+        src = file + vma->offset + (page - vma->start);
+        if (!write && page + PAGE_SIZE <= vma->file_end) {
+            uint64_t phys = vmm_translate(vmm_kernel(), (uint64_t)src);
+            if (phys == 0) return -ENOMEM;
+            return vmm_map(space->pml4, page, phys, flags | PTE_SHARED | cow);
+        }
+    } else if (!write) {
+        uint64_t phys = get_zero_page();
+        if (phys == 0) return -ENOMEM;
+        return vmm_map(space->pml4, page, phys, flags | PTE_SHARED | cow);
+    }
+
+    // 2. Anything else gets a page of its own, with the file bytes that
+    //    belong there and zeroes after them
+    uint64_t phys = pmm_alloc_zeroed();
+    if (phys == 0) return -ENOMEM;
+    if (src) {
+        uint64_t len = vma->file_end - page < PAGE_SIZE ? vma->file_end - page : PAGE_SIZE;
+        memcpy(PHYS_TO_VIRT(phys), src, len);
+    }
+    if (vma->prot & PROT_WRITE) flags |= PTE_WRITE;
+    if (vmm_map(space->pml4, page, phys, flags) < 0) {
+        pmm_free(phys);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Resolve a page fault at addr in space. 0 if the access can be retried.
+int vmm_fault(struct vm_space *space, uint64_t addr, uint64_t error) {
+    uint64_t page = addr & ~PAGE_MASK;
+    bool write = error & FAULT_WRITE;
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    int err = -EFAULT;
+
+    // 1. The access has to be one the VMA allows
+    struct vma *vma = find_vma(space, page);
+    if (vma == NULL) goto out;
+    if (write && !(vma->prot & PROT_WRITE)) goto out;
+    if ((error & FAULT_EXEC) && !(vma->prot & PROT_EXEC)) goto out;
+    uint64_t flags = PTE_USER | ((vma->prot & PROT_EXEC) ? 0 : vmm_nx());
+
+    // 2. Already mapped: a write to a copy-on-write page, or a TLB entry
+    //    from before the page got its current rights
+    uint64_t pte = vmm_entry(space->pml4, page);
+    if (pte & PTE_PRESENT) {
+        if (!write || (pte & PTE_WRITE)) err = 0;
+        else if (pte & PTE_COW) err = fault_cow(space, page, pte, flags);
+        goto out;
+    }
+
+    // 3. Not there yet
+    err = fault_fill(space, vma, page, write, flags);
+out:
+    spin_unlock_irqrestore(&space->lock, irq);
+    return err;
+}
+
+// Fault in [start, end) for writing, up front
+int vma_populate(struct vm_space *space, uint64_t start, uint64_t end) {
+    for (uint64_t page = start & ~PAGE_MASK; page < end; page += PAGE_SIZE) {
+        int err = vmm_fault(space, page, FAULT_WRITE);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// #PF, from isr14 with interrupts off. A fault in a program's half of the
+// address space is resolved with them back on if they were, it may have to
+// copy pages or read a file. rip points at the saved RIP.
+void page_fault(uint64_t error, uint64_t *rip, uint64_t rsp, uint64_t rflags) {
+    uint64_t addr = read_cr2();
+    tcb_t *task = current_task;
+    bool user = (error & FAULT_USER) || *rip < USER_END;
+    bool in_space = task->space && addr < USER_END && !(error & FAULT_RSVD);
+    if ((user || in_space) && (rflags & RFLAGS_IF)) asm volatile("sti");
+    if (in_space && vmm_fault(task->space, addr, error) == 0) return;
+
+    // A program touching what it doesn't have dies, wherever that was. A
+    // syscall copying to or from it gets -EFAULT, anything else in the
+    // kernel panics.
+    if (user) {
+        printf("Task %u: page fault at %p (error %lx), killed\n", task->tid, addr, error);
+        task_exit(-EFAULT);
+    }
+    if (in_space && uaccess_fixup(rip)) return;
+    printf("\nPage fault at %p (error %lx)", addr, error);
+    exception_panic(14, *rip, rsp);
+}
+
+// The memory half of a fork: a new space with the same VMAs and the same
+// pages, private ones shared copy-on-write. It starts with no open files.
+// NULL if out of memory.
+struct vm_space *vmm_clone_space(struct vm_space *src) {
+    struct vm_space *space = vmm_new_space();
+    if (space == NULL) return NULL;
+
+    uint64_t irq = spin_lock_irqsave(&src->lock);
+    int err = 0;
+    struct vma **tail = &space->vmas;
+    for (struct vma *vma = src->vmas; vma && err == 0; vma = vma->next) {
+        struct vma *copy = malloc(sizeof(struct vma));
+        if (copy == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        *copy = *vma;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+    if (err == 0) err = vmm_copy_user(space->pml4, src->pml4);
+    vmm_flush_space(src); // Its private pages just went read-only
+    space->brk_start = src->brk_start;
+    space->brk = src->brk;
+    space->mmap_next = src->mmap_next;
+    spin_unlock_irqrestore(&src->lock, irq);
+
+    if (err < 0) {
+        vmm_free_space(space);
+        return NULL;
+    }
+    return space;
+}
+
+// A file mapping at the next free spot of the mmap() area, len bytes of the
+// file from offset on and zeroes to the end of the last page. Returns its
+// address.
+int64_t vma_mmap(struct vm_space *space, uint64_t len, uint32_t prot, struct vfs_node *node, uint64_t offset) {
+    uint64_t size = (len + PAGE_MASK) & ~PAGE_MASK;
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    uint64_t virt = space->mmap_next;
+    int64_t ret = -ENOMEM;
+    if (size <= MMAP_END - virt) {
+        ret = insert_vma(space, virt, virt + size, prot, node, offset, virt + len);
+        if (ret == 0) {
+            ret = (int64_t)virt;
+            space->mmap_next += size + PAGE_SIZE; // An unmapped page between mappings catches overruns
+        }
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return ret;
+}
+
+// Remove the VMAs in [start, end). Only whole ones: nothing is split.
+int vma_munmap(struct vm_space *space, uint64_t start, uint64_t end) {
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    for (struct vma *vma = space->vmas; vma && vma->start < end; vma = vma->next) {
+        if (vma->end > start && (vma->start < start || vma->end > end)) {
+            spin_unlock_irqrestore(&space->lock, irq);
+            return -EINVAL;
+        }
+    }
+
+    struct vma *vma = space->vmas;
+    while (vma && vma->start < end) {
+        struct vma *next = vma->next;
+        if (vma->end > start) {
+            unmap_range(space, vma->start, vma->end);
+            remove_vma(space, vma);
+        }
+        vma = next;
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+    return 0;
+}
+
+// brk(): move the end of the heap, which starts right after the program's
+// segments. Returns the new end, or the old one if it can't go there; 0
+// just asks where it is.
+int64_t sys_brk(uint64_t addr) {
+    struct vm_space *space = current_task->space;
+    if (space == NULL) return -EINVAL;
+
+    uint64_t irq = spin_lock_irqsave(&space->lock);
+    uint64_t old_end = (space->brk + PAGE_MASK) & ~PAGE_MASK;
+    uint64_t new_end = (addr + PAGE_MASK) & ~PAGE_MASK;
+    struct vma *heap = find_vma(space, space->brk_start);
+    if (addr < space->brk_start || addr > MMAP_BASE) goto out;
+
+    // 1. Growing only needs the VMA to cover more, shrinking gives back
+    //    what was touched in the part that goes
+    if (new_end > old_end) {
+        if (overlaps(space, old_end, new_end)) goto out;
+        if (heap) heap->end = new_end;
+        else if (insert_vma(space, space->brk_start, new_end, PROT_READ | PROT_WRITE, NULL, 0, 0) < 0) goto out;
+    } else if (new_end < old_end) {
+        unmap_range(space, new_end, old_end);
+        if (new_end == space->brk_start) remove_vma(space, heap);
+        else heap->end = new_end;
+    }
+    space->brk = addr;
+out:;
+    int64_t ret = (int64_t)space->brk;
+    spin_unlock_irqrestore(&space->lock, irq);
+    return ret;
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_FAULT_BASE  0x0000100000000000ull
+#define BENCH_FAULT_PAGES 256
+
+static uint64_t bench_touch(void) {
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FAULT_PAGES; i++) {
+        *(volatile uint8_t *)(BENCH_FAULT_BASE + i * PAGE_SIZE) = 1;
+    }
+    return (rdtsc() - start) / BENCH_FAULT_PAGES;
+}
+
+// What first writes cost: a zero-filled page, then after a fork the copy
+// for the parent, and the child taking the pages nobody shares anymore.
+// Borrows the running task for it, interrupts off.
+void bench_fault(void) {
+    struct vm_space *parent = vmm_new_space();
+    if (parent == NULL) return;
+    if (vma_add(parent, BENCH_FAULT_BASE, BENCH_FAULT_BASE + BENCH_FAULT_PAGES * PAGE_SIZE,
+                PROT_READ | PROT_WRITE, NULL, 0, 0) < 0) {
+        vmm_free_space(parent);
+        return;
+    }
+
+    tcb_t *task = current_task;
+    uint64_t flags = irq_save();
+    task->space = parent;
+    vmm_switch_space(parent);
+    uint64_t zero = bench_touch();
+
+    uint64_t start = rdtsc();
+    struct vm_space *child = vmm_clone_space(parent);
+    uint64_t clone = rdtsc() - start;
+    uint64_t copy = 0, reuse = 0;
+    if (child) {
+        copy = bench_touch();
+        task->space = child;
+        vmm_switch_space(child);
+        reuse = bench_touch();
+    }
+
+    task->space = NULL;
+    vmm_switch_space(NULL);
+    irq_restore(flags);
+    vmm_free_space(parent);
+    if (child == NULL) return;
+    vmm_free_space(child);
+
+    printf("bench: page faults: zero-fill %U cycles, copy-on-write %U cycles, last owner %U cycles\n",
+           zero, copy, reuse);
+    printf("bench: cloning a space with %u pages for a fork: %U cycles\n", BENCH_FAULT_PAGES, clone);
+}
+#endif
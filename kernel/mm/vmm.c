@@ -0,0 +1,376 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <panic.h>
+#include <terminal.h>
+#include <mm.h>
+#include <pmm.h>
+#include <vmm.h>
+
+// 4-level paging on top of whatever Limine set up. Page tables are reached
+// through the HHDM, new ones come from the page allocator.
+//
+// Programs get address spaces of their own: a PML4 whose lower half is
+// theirs and whose upper half points at the kernel's tables. Every kernel
+// half slot gets a table at boot, so a kernel mapping made later shows up
+// in every address space without touching them.
+//
+// Where the CPU has PCIDs, TLB entries are tagged with the PCID in CR3's
+// low bits, and a CR3 write with bit 63 set keeps them: switching address
+// spaces doesn't flush, and a program finds its entries still there when it
+// gets the CPU back. Each CPU hands its PCIDs round robin to the address
+// spaces it ran last, the kernel's always has 0. A space whose PCID was given
+// to another since gets the next one, flushed as it's loaded. Nothing is
+// shared between CPUs, so a freed space needs no shootdown: its id is never
+// seen again, and its entries go when the PCID is next handed out.
+
+#define CR3_NOFLUSH (1ull << 63)
+#define NR_PCIDS    8
+
+struct pcid_slot {
+    uint64_t space_id;
+    uint64_t tlb_gen;   // The space's generation when this CPU last flushed it
+};
+
+struct pcid_cache {
+    struct pcid_slot slot[NR_PCIDS]; // Slot n is PCID n + 1
+    uint32_t next;                   // Slot to hand out next
+    uint32_t active;                 // PCID in CR3
+} __attribute__((aligned(64)));
+
+static uint64_t nx_bit = 0;
+static uint64_t kernel_pml4 = 0;
+static spinlock_t vmm_lock = SPINLOCK_INIT;  // Page table edits (all CPUs share the tables)
+static uint64_t tlb_gen = 0;
+static bool use_pcid = false;
+static bool use_invpcid = false;
+static struct pcid_cache pcids[MAX_CPUS];
+static uint64_t next_space_id = 1;
+
+// Turning PCIDs on needs CR3's low bits clear, which they are in kernel_pml4.
+// Limine already sets CR0.WP, but copy_to_user() relies on it to fault on a
+// program's copy-on-write pages, so make sure.
+static void setup_cpu(void) {
+    write_cr0(read_cr0() | CR0_WP);
+    if (!use_pcid) return;
+    write_cr3(kernel_pml4);
+    write_cr4(read_cr4() | CR4_PCIDE);
+}
+
+void init_vmm(void) {
+    spin_lock_name(&vmm_lock, "vmm");
+
+    // Only use NX if Limine turned it on, otherwise the bit is reserved
+    if (rdmsr(MSR_EFER) & EFER_NXE) nx_bit = PTE_NX;
+    kernel_pml4 = vmm_current();
+
+    // PCIDs, and INVPCID to flush them all at once. Every CPU has the same.
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    use_pcid = c & (1 << 17);
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (use_pcid && a >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        use_invpcid = b & (1 << 10);
+    }
+    setup_cpu();
+    printf("VMM: %s\n", use_invpcid ? "PCID, INVPCID" : use_pcid ? "PCID" : "no PCID");
+
+    uint64_t *pml4 = PHYS_TO_VIRT(kernel_pml4);
+    for (int i = 256; i < 512; i++) {
+        if (pml4[i] & PTE_PRESENT) continue;
+        uint64_t phys = pmm_alloc_zeroed();
+        if (phys == 0) panic("Not enough memory for the kernel page tables.");
+        pml4[i] = phys | PTE_PRESENT | PTE_WRITE;
+    }
+}
+
+void init_vmm_ap(void) {
+    setup_cpu();
+}
+
+// The PML4 Limine booted us with
+uint64_t vmm_kernel(void) {
+    return kernel_pml4;
+}
+
+// Physical address of the active PML4
+uint64_t vmm_current(void) {
+    return read_cr3() & PTE_ADDR_MASK;
+}
+
+// PTE_NX if the CPU honours it, 0 if not
+uint64_t vmm_nx(void) {
+    return nx_bit;
+}
+
+// Get the next level table behind table[index], optionally creating it.
+static uint64_t *next_table(uint64_t *table, int index, bool create, uint64_t flags) {
+    uint64_t entry = table[index];
+    if (entry & PTE_PRESENT) {
+        if (entry & PTE_HUGE) return NULL; // Can't split Limine's big pages
+        // Upper levels must be at least as permissive as any leaf below them
+        if ((flags & PTE_USER) && !(entry & PTE_USER)) table[index] = entry | PTE_USER;
+        return PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+    }
+    if (!create) return NULL;
+
+    uint64_t phys = pmm_alloc_zeroed();
+    if (phys == 0) return NULL;
+    table[index] = phys | PTE_PRESENT | PTE_WRITE | (flags & PTE_USER);
+    return PHYS_TO_VIRT(phys);
+}
+
+static uint64_t *walk(uint64_t pml4, uint64_t virt, bool create, uint64_t flags) {
+    uint64_t *table = PHYS_TO_VIRT(pml4);
+    for (int shift = 39; shift > 12; shift -= 9) {
+        table = next_table(table, (virt >> shift) & 0x1FF, create, flags);
+        if (table == NULL) return NULL;
+    }
+    return &table[(virt >> 12) & 0x1FF];
+}
+
+int vmm_map(uint64_t pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    uint64_t *pte = walk(pml4, virt, true, flags);
+    if (pte == NULL) {
+        spin_unlock_irqrestore(&vmm_lock, irq);
+        return -ENOMEM;
+    }
+
+    bool was_present = *pte & PTE_PRESENT;
+    *pte = (phys & PTE_ADDR_MASK) | (flags & ~PTE_ADDR_MASK) | PTE_PRESENT;
+    if (was_present) invlpg(virt);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return 0;
+}
+
+// Returns the physical page that was mapped there (0 if none). Page tables
+// left empty are not reclaimed.
+uint64_t vmm_unmap(uint64_t pml4, uint64_t virt) {
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    uint64_t *pte = walk(pml4, virt, false, 0);
+    uint64_t phys = 0;
+    if (pte && (*pte & PTE_PRESENT)) {
+        phys = *pte & PTE_ADDR_MASK;
+        *pte = 0;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return phys;
+}
+
+// Every TLB entry this CPU has, under any PCID. Changing CR4.PGE drops
+// them all too, where there's no INVPCID.
+static void flush_all(void) {
+    if (use_invpcid) {
+        invpcid(INVPCID_ALL, 0, 0);
+    } else if (use_pcid) {
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 ^ CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3());
+    }
+}
+
+// invlpg only reaches this CPU, and only its current PCID. For kernel
+// mappings that only tasks touch (kernel stacks), other CPUs needn't be
+// interrupted: bump the generation here and they flush in vmm_sync_tlb()
+// before they use such an address again, which is when switching to a task
+// or when mapping a stack into the slot (map_stack()).
+void vmm_flush_lazy(void) {
+    __atomic_add_fetch(&tlb_gen, 1, __ATOMIC_RELEASE);
+}
+
+// Called by the scheduler on every switch, and after mapping a kernel stack.
+// Interrupts off.
+void vmm_sync_tlb(void) {
+    struct cpu *cpu = this_cpu();
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE);
+    if (cpu->tlb_gen != gen) {
+        cpu->tlb_gen = gen;
+        flush_all();
+    }
+}
+
+// Virtual to physical, including Limine's 2 MiB / 1 GiB pages. 0 if unmapped.
+uint64_t vmm_translate(uint64_t pml4, uint64_t virt) {
+    uint64_t *table = PHYS_TO_VIRT(pml4);
+    for (int shift = 39; shift >= 12; shift -= 9) {
+        uint64_t entry = table[(virt >> shift) & 0x1FF];
+        if (!(entry & PTE_PRESENT)) return 0;
+        if (shift == 12 || (shift <= 30 && (entry & PTE_HUGE))) {
+            uint64_t page_mask = (1ull << shift) - 1;
+            return ((entry & PTE_ADDR_MASK) & ~page_mask) | (virt & page_mask);
+        }
+        table = PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+    }
+    return 0;
+}
+
+// The 4 KiB page table entry for virt, 0 if there's none
+uint64_t vmm_entry(uint64_t pml4, uint64_t virt) {
+    uint64_t *pte = walk(pml4, virt, false, 0);
+    return pte ? *pte : 0;
+}
+
+// A new address space: nothing in the user half, the kernel's upper half
+struct vm_space *vmm_new_space(void) {
+    struct vm_space *space = malloc(sizeof(struct vm_space));
+    if (space == NULL) return NULL;
+    uint64_t phys = pmm_alloc_zeroed();
+    if (phys == 0) {
+        free(space);
+        return NULL;
+    }
+
+    uint64_t *pml4 = PHYS_TO_VIRT(phys);
+    uint64_t *kernel = PHYS_TO_VIRT(kernel_pml4);
+    for (int i = 256; i < 512; i++) pml4[i] = kernel[i];
+    space->pml4 = phys;
+    space->id = __atomic_fetch_add(&next_space_id, 1, __ATOMIC_RELAXED);
+    space->tlb_gen = 0;
+    spin_lock_init(&space->lock);
+    space->vmas = NULL;
+    space->brk_start = space->brk = 0;
+    space->mmap_next = MMAP_BASE;
+    space->fds = NULL;
+    return space;
+}
+
+// A user half table at the given level (3 = PDPT, 1 = page table) and
+// everything below it. Private pages lose a reference (a fork may share
+// them), pages marked PTE_SHARED belong to someone else.
+static void free_table(uint64_t phys, int level) {
+    uint64_t *table = PHYS_TO_VIRT(phys);
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = table[i];
+        if (!(entry & PTE_PRESENT)) continue;
+        if (level > 1) free_table(entry & PTE_ADDR_MASK, level - 1);
+        else if (!(entry & PTE_SHARED)) pmm_free(entry & PTE_ADDR_MASK);
+    }
+    pmm_free(phys);
+}
+
+// Copy a user half table at the given level for a fork. The copy maps the
+// same pages, and private ones go read-only in both, to be copied by
+// whichever side writes first (see vmm_fault()). 0 if out of memory.
+static uint64_t copy_table(uint64_t phys, int level) {
+    uint64_t copy = pmm_alloc_zeroed();
+    if (copy == 0) return 0;
+
+    uint64_t *from = PHYS_TO_VIRT(phys);
+    uint64_t *to = PHYS_TO_VIRT(copy);
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = from[i];
+        if (!(entry & PTE_PRESENT)) continue;
+        if (level > 1) {
+            uint64_t table = copy_table(entry & PTE_ADDR_MASK, level - 1);
+            if (table == 0) {
+                free_table(copy, level);
+                return 0;
+            }
+            to[i] = table | (entry & ~PTE_ADDR_MASK);
+            continue;
+        }
+        if (!(entry & PTE_SHARED)) {
+            if (entry & PTE_WRITE) entry = (entry & ~PTE_WRITE) | PTE_COW;
+            from[i] = entry;
+            pmm_ref(entry & PTE_ADDR_MASK);
+        }
+        to[i] = entry;
+    }
+    return copy;
+}
+
+// Give dst (a new space) the same user half as src. The caller flushes src,
+// its writable pages just went read-only. On failure, dst has part of it.
+int vmm_copy_user(uint64_t dst, uint64_t src) {
+    uint64_t *from = PHYS_TO_VIRT(src);
+    uint64_t *to = PHYS_TO_VIRT(dst);
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    int err = 0;
+    for (int i = 0; i < 256 && err == 0; i++) {
+        if (!(from[i] & PTE_PRESENT)) continue;
+        uint64_t table = copy_table(from[i] & PTE_ADDR_MASK, 3);
+        if (table == 0) err = -ENOMEM;
+        else to[i] = table | (from[i] & ~PTE_ADDR_MASK);
+    }
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return err;
+}
+
+// Give back an address space's pages, tables, VMAs and file table. No CPU
+// may be using it.
+void vmm_free_space(struct vm_space *space) {
+    uint64_t *table = PHYS_TO_VIRT(space->pml4);
+    for (int i = 0; i < 256; i++) {
+        if (table[i] & PTE_PRESENT) free_table(table[i] & PTE_ADDR_MASK, 3);
+    }
+    pmm_free(space->pml4);
+
+    while (space->vmas) {
+        struct vma *vma = space->vmas;
+        space->vmas = vma->next;
+        free(vma);
+    }
+    free(space->fds);
+    free(space);
+}
+
+// Switch to an address space, NULL being the kernel's. Interrupts off.
+void vmm_switch_space(struct vm_space *space) {
+    uint64_t pml4 = space ? space->pml4 : kernel_pml4;
+    if (!use_pcid) {
+        if (vmm_current() != pml4) write_cr3(pml4);
+        return;
+    }
+
+    // 1. The kernel's never needs a flush here: kernel mappings go through
+    //    vmm_flush_lazy(), which flushes every PCID
+    struct pcid_cache *cache = &pcids[this_cpu_id()];
+    if (space == NULL) {
+        if (cache->active != 0) write_cr3(pml4 | CR3_NOFLUSH);
+        cache->active = 0;
+        return;
+    }
+
+    // 2. The space's PCID on this CPU, or the next one up for grabs. What's
+    //    tagged with it is stale if it's new or the space lost mappings
+    //    since this CPU last flushed it.
+    uint64_t gen = __atomic_load_n(&space->tlb_gen, __ATOMIC_ACQUIRE);
+    uint32_t n = 0;
+    while (n < NR_PCIDS && cache->slot[n].space_id != space->id) n++;
+    bool flush = n == NR_PCIDS || cache->slot[n].tlb_gen != gen;
+    if (n == NR_PCIDS) {
+        n = cache->next;
+        cache->next = (n + 1) % NR_PCIDS;
+        cache->slot[n].space_id = space->id;
+    }
+    cache->slot[n].tlb_gen = gen;
+
+    // 3. Load it, keeping its entries unless they're stale
+    if (cache->active == n + 1 && !flush) return;
+    cache->active = n + 1;
+    write_cr3(pml4 | (n + 1) | (flush ? 0 : CR3_NOFLUSH));
+}
+
+// One of space's user mappings was taken away or lost rights. Other CPUs
+// may still have it under the space's PCID, and flush it the next time they
+// switch to the space. So may this one, if the task moved here after its
+// invlpg: the space is flushed here too if it's loaded.
+void vmm_flush_space(struct vm_space *space) {
+    __atomic_add_fetch(&space->tlb_gen, 1, __ATOMIC_RELEASE);
+    if (!use_pcid) return; // Every switch to it flushes anyway
+
+    uint64_t flags = irq_save();
+    struct pcid_cache *cache = &pcids[this_cpu_id()];
+    if (cache->active && cache->slot[cache->active - 1].space_id == space->id) vmm_switch_space(space);
+    irq_restore(flags);
+}
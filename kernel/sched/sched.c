@@ -0,0 +1,728 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <cpu.h>
+#include <idt.h>
+#include <clock.h>
+#include <clockevent.h>
+#include <timer.h>
+#include <panic.h>
+#include <terminal.h>
+#include <task.h>
+#include <wait.h>
+#include <apic.h>
+#include <vmm.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <softirq.h>
+#include <fpu.h>
+#include <uaccess.h>
+
+// O(1) scheduler: one FIFO per priority and a bitmap of the non-empty ones.
+// Picking the next task is a bsf on the bitmap plus a list pop, however many
+// tasks there are. Only READY tasks are ever on a queue.
+//
+// Every CPU has its own run queue and schedules on its own. A queue's lock
+// is held from picking the next task until the switch is done (it's dropped
+// by whatever runs next, see sched_finish_switch), so nobody can wake or take
+// a task while its old CPU is still on its stack.
+//
+// A CPU that runs out of work steals from the busiest other queue, and a
+// CPU that queues up work while others sit idle sends one of them a kick to
+// come and get it. Stealing prefers tasks that haven't run for a while, so
+// a task that's still cache-hot stays on its CPU unless nothing else can go.
+//
+// There's no periodic tick (unless the PIT fallback is in use): after every
+// decision the timer is armed for the next event that matters, the running
+// task's slice if something else of its priority is waiting, or the next
+// kernel timer (sleeps included). With nothing competing, the CPU takes no
+// timer interrupts.
+
+struct runqueue {
+    spinlock_t lock;
+    uint32_t bitmap;                   // Bit n set = queue[n] not empty
+    tcb_t *head[SCHED_PRIORITIES];
+    tcb_t *tail[SCHED_PRIORITIES];
+    uint32_t nr_ready;
+    uint32_t nr_movable;               // READY and not pinned, i.e. stealable
+    bool need_resched;
+    tcb_t *idle;
+};
+
+bool scheduler_enabled = false;
+
+extern void context_switch(uint64_t *prev_rsp, uint64_t next_rsp);
+
+static struct runqueue runqueues[MAX_CPUS];
+static uint32_t next_cpu = 0;
+static uint64_t idle_cpus = 0;         // Bit n set = CPU n is running its idle task
+static percpu_counter_t nr_switches;
+static percpu_counter_t nr_steals;
+static percpu_hist_t hists[SCHED_HISTS];
+static uint32_t timeslice[SCHED_PRIORITIES] = {
+    [0 ... SCHED_PRIORITIES - 1] = SCHED_DEFAULT_SLICE_US
+};
+
+static inline struct runqueue *this_rq(void) {
+    return &runqueues[this_cpu_id()];
+}
+
+static inline uint32_t rq_cpu(struct runqueue *rq) {
+    return rq - runqueues;
+}
+
+void sched_set_timeslice(int priority, uint32_t us) {
+    if (priority < 0 || priority >= SCHED_PRIORITIES || us == 0) return;
+    timeslice[priority] = us;
+}
+
+// Arm this CPU's timer for the next thing it has to do something about
+static void sched_rearm(struct runqueue *rq) {
+    uint64_t deadline = timer_next_deadline();
+    tcb_t *curr = this_cpu()->current;
+
+    // The slice only matters if someone is waiting for it to end
+    if (curr && rq->bitmap && (int)bsf(rq->bitmap) <= curr->priority) {
+        if (curr->slice_end < deadline) deadline = curr->slice_end;
+    }
+    if (deadline != CLOCKEVENT_NONE) clockevent_program(deadline);
+}
+
+// All of these want rq->lock held
+static void enqueue(struct runqueue *rq, tcb_t *task, bool front) {
+    int prio = task->priority;
+    if (task->state != TASK_READY) task->ready_since = rdtsc(); // Not when it's just moving queues
+    task->state = TASK_READY;
+    task->cpu = rq_cpu(rq);
+    if (front) {
+        task->rq_prev = NULL;
+        task->rq_next = rq->head[prio];
+        if (rq->head[prio]) rq->head[prio]->rq_prev = task;
+        else rq->tail[prio] = task;
+        rq->head[prio] = task;
+    } else {
+        task->rq_next = NULL;
+        task->rq_prev = rq->tail[prio];
+        if (rq->tail[prio]) rq->tail[prio]->rq_next = task;
+        else rq->head[prio] = task;
+        rq->tail[prio] = task;
+    }
+    rq->bitmap |= 1u << prio;
+    rq->nr_ready++;
+    if (!task->pinned) rq->nr_movable++;
+}
+
+static void dequeue(struct runqueue *rq, tcb_t *task) {
+    int prio = task->priority;
+    if (task->rq_prev) task->rq_prev->rq_next = task->rq_next;
+    else rq->head[prio] = task->rq_next;
+    if (task->rq_next) task->rq_next->rq_prev = task->rq_prev;
+    else rq->tail[prio] = task->rq_prev;
+    if (rq->head[prio] == NULL) rq->bitmap &= ~(1u << prio);
+    task->rq_next = task->rq_prev = NULL;
+    rq->nr_ready--;
+    if (!task->pinned) rq->nr_movable--;
+}
+
+// Most urgent READY task, or NULL
+static tcb_t *pick_next(struct runqueue *rq) {
+    if (rq->bitmap == 0) return NULL;
+    return rq->head[bsf(rq->bitmap)];
+}
+
+// rq's CPU is busy and task has to wait there: get an idle CPU to steal it
+static void kick_idle(struct runqueue *rq, tcb_t *task) {
+    uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED) & ~(1ull << rq_cpu(rq));
+    if (task->pinned || idle == 0) return;
+
+    uint32_t cpu = bsf(idle);
+    if (cpu == this_cpu_id()) clockevent_program(rdtsc());
+    else lapic_send_ipi(cpus[cpu]->lapic_id, RESCHED_IPI_VECTOR);
+}
+
+// Tell rq's CPU about a task that just arrived. With preempt, it takes the
+// CPU as soon as it's at least as urgent as what's running; otherwise the
+// CPU only needs to start slicing.
+static void kick(struct runqueue *rq, tcb_t *task, bool preempt) {
+    uint32_t cpu = rq_cpu(rq);
+    tcb_t *curr = cpus[cpu]->current;
+    if (curr && curr != rq->idle) kick_idle(rq, task);
+    if (curr && task->priority > curr->priority) return; // It waits its turn either way
+
+    if (preempt) rq->need_resched = true;
+    if (cpu != this_cpu_id()) {
+        lapic_send_ipi(cpus[cpu]->lapic_id, RESCHED_IPI_VECTOR);
+    } else if (preempt) {
+        clockevent_program(rdtsc()); // The interrupt does the switch
+    } else {
+        sched_rearm(rq);
+    }
+}
+
+// Put a task at the back of its CPU's queue for its priority
+void sched_enqueue(tcb_t *task) {
+    struct runqueue *rq = &runqueues[task->cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    task->ready_since = rdtsc(); // A new task is READY (0) already, enqueue() wouldn't notice
+    enqueue(rq, task, false);
+    if (scheduler_enabled) kick(rq, task, false);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// Take a task off its run queue if it's on one. Holding its queue's lock
+// also means its CPU has finished switching away from it.
+void sched_dequeue(tcb_t *task) {
+    struct runqueue *rq = &runqueues[task->cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_READY) dequeue(rq, task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+void sched_set_priority(tcb_t *task, int priority) {
+    if (priority < 0 || priority >= SCHED_PRIORITIES) return;
+
+    struct runqueue *rq = &runqueues[task->cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_READY) {
+        dequeue(rq, task);
+        task->priority = priority;
+        enqueue(rq, task, false);
+    } else {
+        task->priority = priority;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// Where a new task should start: the online CPUs in turn
+uint32_t sched_pick_cpu(void) {
+    for (uint32_t tries = 0; tries < cpu_count; tries++) {
+        uint32_t cpu = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) % cpu_count;
+        if (cpus[cpu] && cpus[cpu]->online) return cpu;
+    }
+    return 0;
+}
+
+// Both queues' locks, lowest CPU first so two stealers can't deadlock
+static void lock_pair(struct runqueue *a, struct runqueue *b) {
+    if (a > b) { struct runqueue *t = a; a = b; b = t; }
+    spin_lock(&a->lock);
+    spin_lock(&b->lock);
+}
+
+// The task to take from a busy queue: the most urgent one that may move,
+// from the back of its queue (the one that would wait longest), and one
+// that's gone cold if there is one.
+static tcb_t *pick_steal(struct runqueue *rq) {
+    uint64_t now = rdtsc();
+    uint64_t hot = tsc_from_us(SCHED_MIGRATION_COST_US);
+    tcb_t *fallback = NULL;
+
+    uint32_t bitmap = rq->bitmap;
+    while (bitmap) {
+        int prio = bsf(bitmap);
+        bitmap &= bitmap - 1;
+        for (tcb_t *task = rq->tail[prio]; task; task = task->rq_prev) {
+            if (task->pinned) continue;
+            if (now - task->last_ran >= hot) return task;
+            if (fallback == NULL) fallback = task;
+        }
+        if (fallback) return fallback;
+    }
+    return NULL;
+}
+
+// Move one task from the busiest other queue to ours. Interrupts off.
+static bool steal_task(void) {
+    struct runqueue *rq = this_rq();
+
+    // 1. Find the busiest queue with a quick, unlocked look
+    struct runqueue *busiest = NULL;
+    uint32_t most = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        uint32_t movable = __atomic_load_n(&runqueues[i].nr_movable, __ATOMIC_RELAXED);
+        if (&runqueues[i] != rq && movable > most) {
+            most = movable;
+            busiest = &runqueues[i];
+        }
+    }
+    if (busiest == NULL) return false;
+
+    // 2. Check again with both locks held and move it over
+    lock_pair(rq, busiest);
+    tcb_t *task = busiest->nr_movable ? pick_steal(busiest) : NULL;
+    if (task) {
+        dequeue(busiest, task);
+        enqueue(rq, task, false);
+        percpu_counter_add(&nr_steals, 1);
+    }
+    spin_unlock(&busiest->lock);
+    spin_unlock(&rq->lock);
+    return task != NULL;
+}
+
+// Runs when nothing else can: look for work elsewhere, and if there is none
+// sleep until the next interrupt (which may be a kick to come and look again)
+static void idle_loop(void) {
+    while (1) {
+        asm volatile("cli");
+        if (scheduler_enabled && steal_task()) schedule();
+        else asm volatile("sti; hlt");
+    }
+}
+
+void init_sched(void) {
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&runqueues[i].lock);
+        spin_lock_name(&runqueues[i].lock, "runqueue");
+    }
+
+    tcb_t *idle = create_task_pinned(idle_loop, 0);
+    if (idle == NULL) panic("Could not create the idle task.");
+    sched_set_priority(idle, SCHED_PRIO_IDLE);
+    runqueues[0].idle = idle;
+}
+
+// An AP's boot context becomes its idle task. Doesn't return.
+void sched_start_ap(void) {
+    tcb_t *idle = adopt_task(SCHED_PRIO_IDLE);
+    if (idle == NULL) panic("Could not create an idle task.");
+    idle->pinned = true;
+    this_rq()->idle = idle;
+    __atomic_or_fetch(&idle_cpus, 1ull << this_cpu_id(), __ATOMIC_RELAXED);
+    idle_loop();
+}
+
+// Second half of a switch, run by the task switched to (task_trampoline for
+// a new one): drop the lock the switching CPU took in schedule().
+void sched_finish_switch(void) {
+    spin_unlock(&this_rq()->lock);
+}
+
+// Latency histograms for a switch from prev to next. The idle task's
+// numbers say nothing about latency, so it's left out.
+static void sched_hist_switch(struct runqueue *rq, tcb_t *prev, tcb_t *next, uint64_t now) {
+    if (prev != rq->idle) percpu_hist_add(&hists[SCHED_HIST_SLICE], tsc_to_ns(now - prev->oncpu_since));
+    if (next != rq->idle) percpu_hist_add(&hists[SCHED_HIST_RQ_DELAY], tsc_to_ns(now - next->ready_since));
+    if (next->irq_woken_at) {
+        percpu_hist_add(&hists[SCHED_HIST_IRQ_WAKE], tsc_to_ns(now - next->irq_woken_at));
+        next->irq_woken_at = 0;
+    }
+    next->oncpu_since = now;
+}
+
+// Pick the next task and switch to it. A task that's still RUNNING goes to
+// the back of its queue. rq is this CPU's, locked, interrupts off; returns
+// (whenever the caller next gets a CPU) with the lock dropped. preempted
+// says whether prev is being switched away from against its will, for its
+// statistics.
+static void __schedule(struct runqueue *rq, bool preempted) {
+    struct cpu *cpu = this_cpu();
+    tcb_t *prev = cpu->current;
+    rq->need_resched = false;
+
+    uint64_t now = rdtsc();
+    prev->last_ran = now;
+    prev->run_time += now - prev->switched_in;
+    if (prev->state == TASK_RUNNING) enqueue(rq, prev, false);
+
+    // There's always the idle task, so this can't come back empty
+    tcb_t *next = pick_next(rq);
+    dequeue(rq, next);
+    next->state = TASK_RUNNING;
+    next->slice_end = now + tsc_from_us(timeslice[next->priority]);
+    next->switched_in = now;
+    if (next->woken_at) {
+        uint64_t latency = now - next->woken_at;
+        next->wake_total += latency;
+        if (latency > next->wake_max) next->wake_max = latency;
+        next->nr_wakeups++;
+        next->woken_at = 0;
+    }
+    cpu->current = next;
+    if (next == rq->idle) __atomic_or_fetch(&idle_cpus, 1ull << cpu->id, __ATOMIC_RELAXED);
+    else __atomic_and_fetch(&idle_cpus, ~(1ull << cpu->id), __ATOMIC_RELAXED);
+    sched_rearm(rq);
+
+    if (next != prev) {
+        if (preempted) prev->nr_involuntary++;
+        else prev->nr_voluntary++;
+        sched_hist_switch(rq, prev, next, now);
+        percpu_counter_add(&nr_switches, 1);
+        vmm_sync_tlb();
+        vmm_switch_space(next->space);
+        if (next->space) {
+            // Where it comes back in from ring 3: interrupts through the
+            // TSS, syscalls through kernel_rsp
+            cpu->gdt.tss.rsp[0] = next->stack_top;
+            cpu->kernel_rsp = next->stack_top;
+        }
+        fpu_switch(prev);
+        context_switch(&prev->rsp, next->rsp);
+    }
+    sched_finish_switch();
+}
+
+void schedule(void) {
+    // Safety check: if multitasking isn't ready, don't switch!
+    if (!scheduler_enabled) return;
+
+    struct runqueue *rq = this_rq();
+    spin_lock(&rq->lock);
+    __schedule(rq, false);
+}
+
+// Take the running task off the CPU until someone sched_wake()s it. Call
+// with interrupts off, after putting the task where its waker will look.
+// If that place is protected by a lock, pass it as release: it's dropped
+// only once the task is marked BLOCKED, so the waker can't miss it.
+void sched_block(spinlock_t *release) {
+    if (!scheduler_enabled) panic("Tried to block before the scheduler started.");
+
+    struct runqueue *rq = this_rq();
+    spin_lock(&rq->lock);
+    if (this_cpu()->current == rq->idle) panic("The idle task tried to block.");
+    if (this_cpu()->in_softirq) panic("Tried to block in a softirq.");
+    this_cpu()->current->state = TASK_BLOCKED;
+    if (release) spin_unlock(release);
+    __schedule(rq, false);
+}
+
+// sched_block() for good: the task is marked DEAD and never runs again. Its
+// stack stays in use until the switch away is done, which whoever frees it
+// waits for by taking this queue's lock (see sched_dequeue).
+void sched_exit(spinlock_t *release) {
+    if (!scheduler_enabled) panic("A task exited before the scheduler started.");
+
+    struct runqueue *rq = this_rq();
+    spin_lock(&rq->lock);
+    if (this_cpu()->current == rq->idle) panic("The idle task tried to exit.");
+    if (this_cpu()->in_softirq) panic("Tried to exit in a softirq.");
+    this_cpu()->current->state = TASK_DEAD;
+    if (release) spin_unlock(release);
+    __schedule(rq, false);
+    panic("A dead task was scheduled.");
+    __builtin_unreachable();
+}
+
+// Make a blocked task runnable again, on the CPU it last ran on. It goes to
+// the FRONT of its queue and, if it's at least as urgent as what's running
+// there, takes that CPU right away.
+void sched_wake(tcb_t *task) {
+    struct runqueue *rq = &runqueues[task->cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_BLOCKED) {
+        task->woken_at = rdtsc();
+        task->irq_woken_at = this_cpu()->irq_start;
+        enqueue(rq, task, true);
+        kick(rq, task, true);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// Give up the CPU to the next ready task of the same or higher priority
+void yield(void) {
+    uint64_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+// Reschedule request by interrupt (int $RESCHED_VECTOR). Same result as
+// yield(), but through the full interrupt frame, like a preemption.
+void sched_resched_irq(void) {
+    schedule();
+}
+
+// Timer interrupt (after the due timers ran) or a kick from another CPU:
+// switch if the slice is used up or something at least as urgent was just
+// woken or something more urgent is ready. Otherwise just re-arm the timer.
+void sched_tick(void) {
+    // An interrupt that came in during a softirq leaves it to the irq_exit()
+    // it interrupted, which goes on to call us again
+    if (!scheduler_enabled || this_cpu()->in_softirq) return;
+
+    struct runqueue *rq = this_rq();
+    spin_lock(&rq->lock);
+
+    tcb_t *prev = this_cpu()->current;
+    tcb_t *next = pick_next(rq);
+    if (rq->need_resched || rdtsc() >= prev->slice_end || (next && next->priority < prev->priority)) {
+        __schedule(rq, true);
+    } else {
+        sched_rearm(rq);
+        spin_unlock(&rq->lock);
+    }
+}
+
+void sched_ipi(void) {
+    uint64_t outer = irq_enter();
+    lapic_eoi();
+    irq_exit(outer);
+    sched_tick();
+}
+
+// Context switches and steals so far, over all CPUs
+void sched_stats(uint64_t *switches, uint64_t *steals) {
+    *switches = percpu_counter_read(&nr_switches);
+    *steals = percpu_counter_read(&nr_steals);
+}
+
+// Copy one of the SCHED_HIST_* histograms, summed over all CPUs, into
+// buckets[HIST_BUCKETS]
+int64_t sys_sched_hist(uint64_t which, uint64_t *buckets) {
+    if (which >= SCHED_HISTS) return -EINVAL;
+    uint64_t sums[HIST_BUCKETS];
+    percpu_hist_read(&hists[which], sums);
+    int err = copy_to_user(buckets, sums, sizeof(sums));
+    return err < 0 ? err : HIST_BUCKETS;
+}
+
+// Print the histograms, leaving out the empty buckets at either end
+void sched_hist_dump(void) {
+    static const char *names[SCHED_HISTS] = {
+        "run queue delay", "time slice used", "interrupt to task"
+    };
+
+    for (uint32_t h = 0; h < SCHED_HISTS; h++) {
+        uint64_t buckets[HIST_BUCKETS], total = 0, most = 0;
+        percpu_hist_read(&hists[h], buckets);
+        int first = -1, last = -1;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (buckets[b] == 0) continue;
+            if (first < 0) first = b;
+            last = b;
+            total += buckets[b];
+            if (buckets[b] > most) most = buckets[b];
+        }
+
+        printf("%s (ns): %U samples\n", names[h], total);
+        for (int b = first; first >= 0 && b <= last; b++) {
+            if (b == HIST_BUCKETS - 1) printf("  %10U and up     %9U ", 1ull << b, buckets[b]);
+            else printf("  %10U - %10U %9U ", b ? 1ull << b : 0, (1ull << (b + 1)) - 1, buckets[b]);
+            for (uint64_t i = 0; i < buckets[b] * 40 / most; i++) putc('#');
+            putc('\n');
+        }
+    }
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_SWITCHES 100000
+
+static wait_queue_t bench_done = WAIT_QUEUE_INIT;
+static wait_queue_t bench_park = WAIT_QUEUE_INIT;
+static volatile bool bench_use_int;
+static volatile bool bench_use_fpu;
+static volatile uint32_t bench_finished;
+static volatile uint64_t bench_start, bench_end;
+
+// The last task to finish wakes us before it parks, and we may be running
+// on another CPU by then: wait until it's really off its CPU.
+static void bench_wait_parked(tcb_t *task) {
+    while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_BLOCKED) cpu_relax();
+}
+
+// Two of these at the same high priority hand the CPU back and forth
+static void bench_pingpong(void) {
+    if (bench_start == 0) bench_start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SWITCHES / 2; i++) {
+        // Dirty an SSE register, so every switch has to save and restore.
+        // The kernel never uses xmm0 itself.
+        if (bench_use_fpu) asm volatile("addps %%xmm0, %%xmm0" : : : "memory");
+        if (bench_use_int) asm volatile("int %0" : : "i"(RESCHED_VECTOR) : "memory");
+        else yield();
+    }
+
+    // The first one done stops the clock, the partner has nobody left to switch to
+    uint64_t flags = irq_save();
+    if (bench_finished++ == 0) bench_end = rdtsc();
+    else wake_one(&bench_done);
+    wait_on(&bench_park);
+    irq_restore(flags);
+}
+
+// use_space gives each task an (empty) address space of its own
+static uint64_t bench_switch(bool use_int, bool use_fpu, bool use_space) {
+    bench_use_int = use_int;
+    bench_use_fpu = use_fpu;
+    bench_finished = 0;
+    bench_start = bench_end = 0;
+
+    // 1. Start both with interrupts off so they can't finish before we wait
+    uint64_t flags = irq_save();
+    tcb_t *a = create_task_pinned(bench_pingpong, this_cpu_id());
+    tcb_t *b = create_task_pinned(bench_pingpong, this_cpu_id());
+    if (a == NULL || b == NULL) panic("bench: could not create tasks");
+    if (use_space) {
+        a->space = vmm_new_space();
+        b->space = vmm_new_space();
+        if (a->space == NULL || b->space == NULL) panic("bench: could not create address spaces");
+    }
+    sched_set_priority(a, SCHED_PRIO_HIGH);
+    sched_set_priority(b, SCHED_PRIO_HIGH);
+    while (bench_finished < 2) wait_on(&bench_done);
+
+    // 2. Both are parked now, reclaim them
+    bench_wait_parked(a);
+    bench_wait_parked(b);
+    wait_queue_init(&bench_park);
+    destroy_task(a);
+    destroy_task(b);
+    irq_restore(flags);
+
+    return (bench_end - bench_start) / BENCH_SWITCHES;
+}
+
+void bench_sched(void) {
+    uint64_t voluntary = bench_switch(false, false, false);
+    uint64_t forced = bench_switch(true, false, false);
+    uint64_t fpu = bench_switch(false, true, false);
+    uint64_t space = bench_switch(false, false, true);
+
+    // The timer path also acks the PIC, roughly one port write
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1000; i++) asm volatile("outb %%al, $0x80" : : "a"(0));
+    uint64_t eoi = (rdtsc() - start) / 1000;
+
+    printf("bench: context switch: yield %U cycles, interrupt %U cycles (+%U for the EOI on a timer preemption)\n",
+           voluntary, forced, eoi);
+    printf("bench: context switch with the FPU in use: yield %U cycles\n", fpu);
+    printf("bench: context switch between address spaces: yield %U cycles\n", space);
+}
+
+#define BENCH_STEAL_TASKS 64
+#define BENCH_STEAL_SPIN  2000000
+
+static tcb_t *bench_workers[BENCH_STEAL_TASKS];
+
+// A short burst of pure CPU work, the same amount wherever it runs
+static void bench_worker(void) {
+    for (uint32_t i = 0; i < BENCH_STEAL_SPIN; i++) asm volatile("" : : : "memory");
+
+    uint64_t flags = irq_save();
+    if (__atomic_add_fetch(&bench_finished, 1, __ATOMIC_ACQ_REL) == BENCH_STEAL_TASKS) {
+        bench_end = rdtsc();
+        wake_one(&bench_done);
+    }
+    wait_on(&bench_park);
+    irq_restore(flags);
+}
+
+// Spawn the whole batch on this CPU and time it until the last one is done
+static uint64_t bench_burst(bool pinned) {
+    bench_finished = 0;
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = this_cpu_id();
+    bench_start = rdtsc();
+    for (int i = 0; i < BENCH_STEAL_TASKS; i++) {
+        bench_workers[i] = pinned ? create_task_pinned(bench_worker, cpu) : create_task_on(bench_worker, cpu);
+        if (bench_workers[i] == NULL) panic("bench: could not create tasks");
+    }
+    spin_lock(&bench_done.lock); // The workers finish on other CPUs
+    while (bench_finished < BENCH_STEAL_TASKS) {
+        wait_on_locked(&bench_done);
+        spin_lock(&bench_done.lock);
+    }
+    spin_unlock(&bench_done.lock);
+
+    for (int i = 0; i < BENCH_STEAL_TASKS; i++) bench_wait_parked(bench_workers[i]);
+    wait_queue_init(&bench_park);
+    for (int i = 0; i < BENCH_STEAL_TASKS; i++) destroy_task(bench_workers[i]);
+    irq_restore(flags);
+
+    return tsc_to_ns(bench_end - bench_start) / 1000;
+}
+
+static void (*bench_fn)(void);
+static volatile uint32_t bench_ready;
+static uint32_t bench_ncpus;
+
+static void bench_percpu(void) {
+    // 1. Start together, the last one to show up starts the clock
+    if (__atomic_add_fetch(&bench_ready, 1, __ATOMIC_ACQ_REL) == bench_ncpus) bench_start = rdtsc();
+    while (__atomic_load_n(&bench_ready, __ATOMIC_ACQUIRE) < bench_ncpus) cpu_relax();
+
+    bench_fn();
+
+    // 2. And the last one done stops it
+    uint64_t flags = irq_save();
+    if (__atomic_add_fetch(&bench_finished, 1, __ATOMIC_ACQ_REL) == bench_ncpus) {
+        bench_end = rdtsc();
+        wake_one(&bench_done);
+    }
+    wait_on(&bench_park);
+    irq_restore(flags);
+}
+
+// Run fn at the same time on CPUs 0 to ncpus-1, one pinned task each, and
+// return how many cycles it took until all of them were done
+uint64_t bench_on_cpus(void (*fn)(void), uint32_t ncpus) {
+    static tcb_t *tasks[MAX_CPUS];
+    bench_fn = fn;
+    bench_ncpus = ncpus;
+    bench_ready = 0;
+    bench_finished = 0;
+
+    uint64_t flags = irq_save();
+    for (uint32_t i = 0; i < ncpus; i++) {
+        tasks[i] = create_task_pinned(bench_percpu, i);
+        if (tasks[i] == NULL) panic("bench: could not create tasks");
+        sched_set_priority(tasks[i], SCHED_PRIO_HIGH);
+    }
+    spin_lock(&bench_done.lock);
+    while (bench_finished < ncpus) {
+        wait_on_locked(&bench_done);
+        spin_lock(&bench_done.lock);
+    }
+    spin_unlock(&bench_done.lock);
+
+    for (uint32_t i = 0; i < ncpus; i++) bench_wait_parked(tasks[i]);
+    wait_queue_init(&bench_park);
+    for (uint32_t i = 0; i < ncpus; i++) destroy_task(tasks[i]);
+    irq_restore(flags);
+
+    return bench_end - bench_start;
+}
+
+#define BENCH_SPAWN_TASKS 1000
+
+static void bench_spawn_nop(void) {
+}
+
+// Create a task that does nothing, join it, repeat: the whole lifecycle of
+// a short-lived task. Then the same with detached tasks left to the reaper,
+// which frees them in batches.
+void bench_spawn(void) {
+    uint32_t cpu = this_cpu_id();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SPAWN_TASKS; i++) {
+        tcb_t *task = create_task_on(bench_spawn_nop, cpu);
+        if (task == NULL) panic("bench: could not create tasks");
+        if (task_join(task->tid, NULL) < 0) panic("bench: could not join a task");
+    }
+    uint64_t joined = (rdtsc() - start) / BENCH_SPAWN_TASKS;
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_SPAWN_TASKS; i++) {
+        tcb_t *task = create_task_on(bench_spawn_nop, cpu);
+        if (task == NULL) panic("bench: could not create tasks");
+        task_detach(task);
+        yield(); // Let it run, so they don't pile up
+    }
+    uint64_t detached = (rdtsc() - start) / BENCH_SPAWN_TASKS;
+
+    printf("bench: task create+exit+join %U cycles, create+detach+run %U cycles\n", joined, detached);
+}
+
+void bench_steal(void) {
+    uint64_t switches, steals_before, steals_after;
+    uint64_t one = bench_burst(true);
+    sched_stats(&switches, &steals_before);
+    uint64_t all = bench_burst(false);
+    sched_stats(&switches, &steals_after);
+    uint64_t speedup = all ? one * 100 / all : 0;
+
+    printf("bench: %u short tasks: %U us on 1 CPU, %U us across %u CPUs with %U steals (x%U.%U)\n",
+           BENCH_STEAL_TASKS, one, all, cpu_count, steals_after - steals_before, speedup / 100, speedup % 100 / 10);
+}
+#endif
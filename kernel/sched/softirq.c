@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <panic.h>
+#include <percpu.h>
+#include <softirq.h>
+
+// Each CPU has a bitmap of raised softirqs in its struct cpu. Raising one
+// is setting a bit with interrupts off, running them is irq_exit() at the
+// end of a hard interrupt: take the bitmap, turn interrupts on, call the
+// handlers, and go again if anything was raised meanwhile. While a CPU is
+// in a softirq, interrupts that hit it don't run softirqs or switch tasks
+// themselves, they leave that to the irq_exit() they interrupted.
+
+static void (*handlers[NR_SOFTIRQS])(void);
+
+// Scheduled tasklets, per CPU
+static struct tasklet *tasklets[MAX_CPUS];
+
+void open_softirq(int nr, void (*handler)(void)) {
+    handlers[nr] = handler;
+}
+
+// Safe from any context. Runs at the next irq_exit() on this CPU.
+void raise_softirq(int nr) {
+    uint64_t flags = irq_save();
+    this_cpu()->softirq_pending |= 1u << nr;
+    irq_restore(flags);
+}
+
+bool in_softirq(void) {
+    return this_cpu()->in_softirq;
+}
+
+// Start of a hard interrupt handler, interrupts off. Returns the start of
+// the interrupt we may have come in on top of, for irq_exit() to put back.
+uint64_t irq_enter(void) {
+    struct cpu *cpu = this_cpu();
+    uint64_t outer = cpu->irq_start;
+    cpu->irq_start = rdtsc();
+    return outer;
+}
+
+// End of a hard interrupt handler, interrupts still off
+void irq_exit(uint64_t outer) {
+    struct cpu *cpu = this_cpu();
+    if (cpu->in_softirq || cpu->softirq_pending == 0) {
+        cpu->irq_start = outer;
+        return;
+    }
+
+    cpu->in_softirq = true;
+    for (int round = 0; round < SOFTIRQ_MAX_RESTART; round++) {
+        uint32_t pending = cpu->softirq_pending;
+        if (pending == 0) break;
+        cpu->softirq_pending = 0;
+
+        asm volatile("sti" : : : "memory");
+        while (pending) {
+            int nr = bsf(pending);
+            pending &= pending - 1;
+            handlers[nr]();
+        }
+        asm volatile("cli" : : : "memory");
+    }
+    cpu->in_softirq = false;
+    cpu->irq_start = outer;
+}
+
+void tasklet_init(struct tasklet *tasklet, void (*fn)(struct tasklet *), void *data) {
+    tasklet->next = NULL;
+    tasklet->pending = false;
+    tasklet->fn = fn;
+    tasklet->data = data;
+}
+
+// Returns false if it was already scheduled (it still only runs once)
+bool tasklet_schedule(struct tasklet *tasklet) {
+    if (__atomic_exchange_n(&tasklet->pending, true, __ATOMIC_ACQ_REL)) return false;
+
+    uint64_t flags = irq_save();
+    struct tasklet **list = &tasklets[this_cpu_id()];
+    tasklet->next = *list;
+    *list = tasklet;
+    this_cpu()->softirq_pending |= 1u << SOFTIRQ_TASKLET;
+    irq_restore(flags);
+    return true;
+}
+
+// Take this CPU's whole list at once and run it with interrupts on
+static void tasklet_softirq(void) {
+    uint64_t flags = irq_save();
+    struct tasklet *list = tasklets[this_cpu_id()];
+    tasklets[this_cpu_id()] = NULL;
+    irq_restore(flags);
+
+    while (list) {
+        struct tasklet *tasklet = list;
+        list = tasklet->next;
+        __atomic_store_n(&tasklet->pending, false, __ATOMIC_RELEASE);
+        tasklet->fn(tasklet);
+    }
+}
+
+void init_softirq(void) {
+    open_softirq(SOFTIRQ_TASKLET, tasklet_softirq);
+}
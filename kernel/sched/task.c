@@ -0,0 +1,488 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <panic.h>
+#include <terminal.h>
+#include <mm.h>
+#include <errno.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <task.h>
+#include <uaccess.h>
+#include <workqueue.h>
+#include <clock.h>
+
+// Task control blocks and their kernel stacks, allocated on demand.
+//
+// TCBs are carved out of whole pages from the page allocator and never go
+// back to the heap. Each TCB owns one stack slot for life, so recycling a
+// TCB recycles its stack too. Released TCBs whose stack is still mapped go
+// on the warm list (up to KSTACK_CACHE_MAX), the rest have their stack pages
+// handed back and go on the cold list. task_lock covers the pools, the task
+// list, the TID hash and exiting.
+//
+// A task that exits stays around as DEAD until someone collects it: whoever
+// task_join()s it gets its exit code and frees it, and a detached one is
+// freed by the reaper, which runs from a work queue.
+
+extern void task_trampoline(void);
+
+tcb_t *task_list = NULL;
+static tcb_t *task_list_tail = NULL;
+
+static tcb_t *warm_pool = NULL;
+static tcb_t *cold_pool = NULL;
+static uint32_t warm_count = 0;
+static uint32_t next_slot = 0;
+static uint32_t next_tid = 1;
+static tcb_t *tid_hash[TID_HASH_SIZE];
+static spinlock_t task_lock = SPINLOCK_INIT;
+
+// Detached tasks that exited, for the reaper
+static tcb_t *zombies = NULL;
+static struct work reap_work;
+
+// Refill the cold pool with a page worth of fresh TCBs
+static bool grow_pool(void) {
+    uint64_t phys = pmm_alloc_zeroed();
+    if (phys == 0) return false;
+
+    tcb_t *tcbs = PHYS_TO_VIRT(phys);
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(tcb_t); i++) {
+        tcbs[i].slot = next_slot++;
+        tcbs[i].pool_next = cold_pool;
+        cold_pool = &tcbs[i];
+    }
+    return true;
+}
+
+static bool map_stack(tcb_t *task) {
+    uint64_t pml4 = vmm_kernel();
+    uint64_t bottom = KSTACK_BASE + (uint64_t)task->slot * KSTACK_SLOT_SIZE + PAGE_SIZE; // Past the guard
+
+    for (uint64_t off = 0; off < STACK_SIZE; off += PAGE_SIZE) {
+        uint64_t phys = pmm_alloc();
+        if (phys == 0 || vmm_map(pml4, bottom + off, phys, PTE_WRITE | vmm_nx()) < 0) {
+            pmm_free(phys);
+            while (off) {
+                off -= PAGE_SIZE;
+                pmm_free(vmm_unmap(pml4, bottom + off));
+            }
+            return false;
+        }
+    }
+    task->stack_top = bottom + STACK_SIZE;
+    task->stack_mapped = true;
+
+    // This CPU may still have the slot's old pages cached from when another
+    // CPU unmapped them, and spawn_task() is about to write the first frame
+    vmm_sync_tlb();
+    return true;
+}
+
+static void unmap_stack(tcb_t *task) {
+    uint64_t pml4 = vmm_kernel();
+    uint64_t bottom = task->stack_top - STACK_SIZE;
+    for (uint64_t off = 0; off < STACK_SIZE; off += PAGE_SIZE) {
+        pmm_free(vmm_unmap(pml4, bottom + off));
+    }
+    task->stack_mapped = false;
+
+    // Other CPUs that ran this task may still have the old pages cached
+    vmm_flush_lazy();
+}
+
+// Get a TCB, preferring one whose stack is still mapped (and likely cached).
+// Call with task_lock held, interrupts off.
+static tcb_t *alloc_tcb(bool need_stack) {
+    tcb_t *task;
+    if (need_stack && warm_pool) {
+        task = warm_pool;
+        warm_pool = task->pool_next;
+        warm_count--;
+    } else {
+        if (cold_pool == NULL && !grow_pool()) return NULL;
+        task = cold_pool;
+        cold_pool = task->pool_next;
+        if (need_stack && !map_stack(task)) {
+            task->pool_next = cold_pool;
+            cold_pool = task;
+            return NULL;
+        }
+    }
+
+    // Clear everything but the stack and FPU area bookkeeping
+    uint32_t slot = task->slot;
+    bool mapped = task->stack_mapped;
+    uint64_t top = task->stack_top;
+    void *fpu_state = task->fpu_state;
+    memset(task, 0, sizeof(tcb_t));
+    task->slot = slot;
+    task->stack_mapped = mapped;
+    task->stack_top = top;
+    task->fpu_state = fpu_state;
+    return task;
+}
+
+static void free_tcb(tcb_t *task) {
+    if (task->stack_mapped && warm_count < KSTACK_CACHE_MAX) {
+        task->pool_next = warm_pool;
+        warm_pool = task;
+        warm_count++;
+        return;
+    }
+    if (task->stack_mapped) unmap_stack(task);
+    task->pool_next = cold_pool;
+    cold_pool = task;
+}
+
+// Gives the task its TID too
+static void link_task(tcb_t *task) {
+    task->prev = task_list_tail;
+    task->next = NULL;
+    if (task_list_tail) task_list_tail->next = task;
+    else task_list = task;
+    task_list_tail = task;
+
+    task->tid = next_tid++;
+    tcb_t **bucket = &tid_hash[task->tid % TID_HASH_SIZE];
+    task->hash_next = *bucket;
+    *bucket = task;
+}
+
+static void unlink_task(tcb_t *task) {
+    if (task->prev) task->prev->next = task->next;
+    else task_list = task->next;
+    if (task->next) task->next->prev = task->prev;
+    else task_list_tail = task->prev;
+
+    tcb_t **link = &tid_hash[task->tid % TID_HASH_SIZE];
+    while (*link != task) link = &(*link)->hash_next;
+    *link = task->hash_next;
+}
+
+// Call with task_lock held
+static tcb_t *find_task(uint32_t tid) {
+    for (tcb_t *task = tid_hash[tid % TID_HASH_SIZE]; task; task = task->hash_next) {
+        if (task->tid == tid) return task;
+    }
+    return NULL;
+}
+
+// Free everything on the zombie list. Runs in a worker, never on one of the
+// dead tasks' own stacks.
+static void reap(struct work *work) {
+    (void)work;
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+    tcb_t *list = zombies;
+    zombies = NULL;
+    spin_unlock_irqrestore(&task_lock, flags);
+
+    while (list) {
+        tcb_t *task = list;
+        list = task->pool_next;
+        destroy_task(task);
+    }
+}
+
+// Hand a DEAD task to the reaper. Call with task_lock held.
+static void queue_reap(tcb_t *task) {
+    task->pool_next = zombies;
+    zombies = task;
+    queue_work(&reap_work);
+}
+
+// Turn whatever is running on this CPU right now into a task. It keeps the
+// stack Limine gave it. Interrupts off.
+tcb_t *adopt_task(int priority) {
+    spin_lock(&task_lock);
+    tcb_t *task = alloc_tcb(false);
+    if (task) link_task(task);
+    spin_unlock(&task_lock);
+    if (task == NULL) return NULL;
+
+    task->state = TASK_RUNNING;
+    task->priority = priority;
+    task->cpu = this_cpu_id();
+    task->created = task->switched_in = task->oncpu_since = rdtsc();
+    this_cpu()->current = task;
+    return task;
+}
+
+// kmain becomes the first task
+void init_tasks(void) {
+    spin_lock_name(&task_lock, "tasks");
+    work_init(&reap_work, reap, NULL);
+    if (adopt_task(SCHED_PRIO_DEFAULT) == NULL) panic("Not enough memory for the boot task.");
+}
+
+tcb_t *create_task(void* entry_point) {
+    return create_task_on(entry_point, sched_pick_cpu());
+}
+
+// Set up a new task and queue it. space and the user_* fields are for
+// programs, NULL and 0 for kernel tasks.
+static tcb_t *spawn_task(void *entry_point, uint32_t cpu, bool pinned, struct vm_space *space, uint64_t user_rip, uint64_t user_rsp) {
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+    tcb_t *task = alloc_tcb(true);
+    if (task) link_task(task);
+    spin_unlock_irqrestore(&task_lock, flags);
+    if (task == NULL) return NULL;
+
+    uint64_t stack_top = task->stack_top & -16LL;
+    uint64_t* stack = (uint64_t*)stack_top;
+
+    // What context_switch pops: r15, r14, r13, r12, rbx, rbp, then it
+    // 'returns' into task_trampoline, which calls the entry point in r12
+    *(--stack) = (uint64_t)task_trampoline;
+    *(--stack) = 0;                     // RBP
+    *(--stack) = 0;                     // RBX
+    *(--stack) = (uint64_t)entry_point; // R12
+    *(--stack) = 0;                     // R13
+    *(--stack) = 0;                     // R14
+    *(--stack) = 0;                     // R15
+
+    task->rsp = (uint64_t)stack;
+    task->parent = current_task->tid;
+    task->created = rdtsc();
+    task->priority = SCHED_PRIO_DEFAULT;
+    task->cpu = cpu;
+    task->pinned = pinned;
+    task->space = space;
+    task->user_rip = user_rip;
+    task->user_rsp = user_rsp;
+    sched_enqueue(task);
+    return task;
+}
+
+// Create a task that starts out on a given CPU's run queue. Idle CPUs may
+// still steal it from there.
+tcb_t *create_task_on(void* entry_point, uint32_t cpu) {
+    return spawn_task(entry_point, cpu, false, NULL, 0, 0);
+}
+
+// Create a task that only ever runs on the given CPU
+tcb_t *create_task_pinned(void* entry_point, uint32_t cpu) {
+    return spawn_task(entry_point, cpu, true, NULL, 0, 0);
+}
+
+// First thing a program's task runs: down to ring 3, onto its own stack and
+// into its code, the address space is already theirs. iretq turns
+// interrupts back on, with the program's GS base swapped in, and no kernel
+// values are left in the registers.
+static void user_task_start(void) {
+    tcb_t *task = current_task;
+    asm volatile("cli");
+    asm volatile(
+        "pushq %0\n"          // SS
+        "pushq %1\n"          // RSP
+        "pushq %2\n"          // RFLAGS
+        "pushq %3\n"          // CS
+        "pushq %4\n"          // RIP
+        "swapgs\n"
+        "xor %%eax, %%eax; xor %%ebx, %%ebx; xor %%ecx, %%ecx; xor %%edx, %%edx\n"
+        "xor %%esi, %%esi; xor %%edi, %%edi; xor %%ebp, %%ebp; xor %%r8d, %%r8d\n"
+        "xor %%r9d, %%r9d; xor %%r10d, %%r10d; xor %%r11d, %%r11d; xor %%r12d, %%r12d\n"
+        "xor %%r13d, %%r13d; xor %%r14d, %%r14d; xor %%r15d, %%r15d\n"
+        "iretq\n"
+        : : "i"(GDT_USER_DS), "r"(task->user_rsp), "i"(RFLAGS_IF | 2), "i"(GDT_USER_CS), "r"(task->user_rip)
+        : "memory");
+    __builtin_unreachable();
+}
+
+// A task for a program loaded into an address space (see elf_spawn).
+// The task owns the address space from here on and frees it when it's
+// destroyed.
+tcb_t *create_user_task(struct vm_space *space, uint64_t entry, uint64_t stack_top) {
+    return spawn_task(user_task_start, sched_pick_cpu(), false, space, entry, stack_top);
+}
+
+// Where a task ends up if its entry point returns
+void task_return(void) {
+    task_exit(0);
+}
+
+// End the running task. Its TCB and stack stay until it's joined, or until
+// the reaper gets to it if it's detached.
+void task_exit(int code) {
+    tcb_t *task = current_task;
+
+    // 1. Interrupts stay off until we're off this stack for good
+    asm volatile("cli");
+    spin_lock(&task_lock);
+    task->exit_code = code;
+
+    // 2. Let whoever collects us know. They can't look before we're DEAD,
+    //    since that needs task_lock, which is only dropped once we are.
+    if (task->detached) queue_reap(task);
+    else if (task->joiner) sched_wake(task->joiner);
+    sched_exit(&task_lock);
+}
+
+// Nobody is going to join this task: free it as soon as it exits
+int task_detach(tcb_t *task) {
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+    int ret = 0;
+    if (task->detached || task->joiner) {
+        ret = -EINVAL;
+    } else {
+        task->detached = true;
+        if (task->state == TASK_DEAD) queue_reap(task);
+    }
+    spin_unlock_irqrestore(&task_lock, flags);
+    return ret;
+}
+
+// Wait for a task to exit, then free it. Its exit code goes to *code, if
+// that's not NULL. Each task can be joined once, and not once detached.
+// With own_only, only tasks the caller created.
+static int join(uint32_t tid, int *code, bool own_only) {
+    tcb_t *self = current_task;
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+
+    // 1. Claim it
+    tcb_t *task = find_task(tid);
+    int ret = 0;
+    if (task == NULL || (own_only && task->parent != self->tid)) ret = -ESRCH;
+    else if (task == self) ret = -EDEADLK;
+    else if (task->detached || task->joiner) ret = -EINVAL;
+    if (ret < 0) {
+        spin_unlock_irqrestore(&task_lock, flags);
+        return ret;
+    }
+    task->joiner = self;
+
+    // 2. Sleep until it's DEAD, task_exit() wakes us
+    while (task->state != TASK_DEAD) {
+        sched_block(&task_lock);
+        spin_lock(&task_lock);
+    }
+    int exit_code = task->exit_code;
+    spin_unlock_irqrestore(&task_lock, flags);
+
+    // 3. Nobody else can get at it now
+    destroy_task(task);
+    if (code) *code = exit_code;
+    return 0;
+}
+
+int task_join(uint32_t tid, int *code) {
+    return join(tid, code, false);
+}
+
+// join(): a program may only wait for tasks it created, not for kernel
+// tasks someone else means to join, or workers that never exit
+int64_t sys_join(uint64_t tid, int *code) {
+    if (tid > UINT32_MAX) return -ESRCH;
+    if (code && !access_ok(code, sizeof(int))) return -EFAULT;
+
+    int exit_code;
+    int ret = join((uint32_t)tid, &exit_code, true);
+    if (ret == 0 && code) ret = copy_to_user(code, &exit_code, sizeof(int));
+    return ret;
+}
+
+// Give a task's TCB and stack back to the pool. Must not be the running task.
+void destroy_task(tcb_t *task) {
+    if (task == current_task) panic("Tried to destroy the running task.");
+    sched_dequeue(task); // Also waits for its CPU to be done switching away from it
+    if (task->space) {
+        vmm_free_space(task->space);
+        task->space = NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+    unlink_task(task);
+    free_tcb(task);
+    spin_unlock_irqrestore(&task_lock, flags);
+}
+
+// Copy the numbers of up to max tasks into stats, in task list order.
+// Returns how many it filled in.
+uint32_t task_snapshot(struct task_stats *stats, uint32_t max) {
+    uint64_t flags = spin_lock_irqsave(&task_lock);
+    uint64_t now = rdtsc();
+    uint32_t count = 0;
+    for (tcb_t *task = task_list; task && count < max; task = task->next) {
+        // The counters are only ever added to, a torn read is just a bit stale
+        struct task_stats *st = &stats[count++];
+        uint64_t run = task->run_time;
+        if (task->state == TASK_RUNNING) run += now - task->switched_in;
+
+        st->tid = task->tid;
+        st->state = task->state;
+        st->priority = task->priority;
+        st->cpu = task->cpu;
+        st->age_ns = tsc_to_ns(now - task->created);
+        st->run_ns = tsc_to_ns(run);
+        st->nr_voluntary = task->nr_voluntary;
+        st->nr_involuntary = task->nr_involuntary;
+        st->nr_wakeups = task->nr_wakeups;
+        st->wake_avg_ns = task->nr_wakeups ? tsc_to_ns(task->wake_total / task->nr_wakeups) : 0;
+        st->wake_max_ns = tsc_to_ns(task->wake_max);
+    }
+    spin_unlock_irqrestore(&task_lock, flags);
+    return count;
+}
+
+// Snapshot into a kernel buffer, growing it until everyone fits or it holds
+// max, then hand that over: the program's buffer may fault, and task_lock
+// is held while snapshotting.
+int64_t sys_task_stats(struct task_stats *stats, uint64_t max) {
+    if (max > UINT32_MAX) max = UINT32_MAX;
+    if (!access_ok(stats, max * sizeof(struct task_stats))) return -EFAULT;
+
+    uint32_t size = max < 64 ? max : 64, count;
+    struct task_stats *buf;
+    while (1) {
+        buf = malloc(size * sizeof(struct task_stats) + 1);
+        if (buf == NULL) return -ENOMEM;
+        count = task_snapshot(buf, size);
+        if (count < size || size == max) break;
+        free(buf);
+        size = max / 2 < size ? max : size * 2;
+    }
+
+    int err = copy_to_user(stats, buf, count * sizeof(struct task_stats));
+    free(buf);
+    return err < 0 ? err : (int64_t)count;
+}
+
+// Print every task, the ones that used the most CPU first. %CPU is of one
+// CPU, over the task's lifetime.
+void task_top(void) {
+    // 1. Snapshot, growing the buffer until everyone fits
+    uint32_t max = 64, count;
+    struct task_stats *stats;
+    while (1) {
+        stats = malloc(max * sizeof(struct task_stats));
+        if (stats == NULL) return;
+        count = task_snapshot(stats, max);
+        if (count < max) break;
+        free(stats);
+        max *= 2;
+    }
+
+    // 2. Busiest first
+    for (uint32_t i = 1; i < count; i++) {
+        struct task_stats st = stats[i];
+        uint32_t j = i;
+        for (; j > 0 && stats[j - 1].run_ns < st.run_ns; j--) stats[j] = stats[j - 1];
+        stats[j] = st;
+    }
+
+    static const char *states[] = { "ready  ", "running", "blocked", "dead   " };
+    printf("  tid prio cpu state    %%cpu    run (ms)     vol   invol   wakeups  wake avg/max (us)\n");
+    for (uint32_t i = 0; i < count; i++) {
+        struct task_stats *st = &stats[i];
+        uint64_t permille = st->age_ns ? st->run_ns * 1000 / st->age_ns : 0;
+        printf("%5u %4u %3u %s %3U.%U %11U %7U %7U %9U  %U/%U\n",
+               st->tid, st->priority, st->cpu, states[st->state], permille / 10, permille % 10,
+               st->run_ns / 1000000, st->nr_voluntary, st->nr_involuntary, st->nr_wakeups,
+               st->wake_avg_ns / 1000, st->wake_max_ns / 1000);
+    }
+    free(stats);
+}
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <errno.h>
+#include <timer.h>
+#include <task.h>
+#include <spinlock.h>
+#include <wait.h>
+
+// Wait queues and sleeping. Both park the task with sched_block() and let
+// whoever is responsible (a waker, or a timer) sched_wake() it.
+//
+// Each queue has a lock, taken before the run queue lock of any task on it.
+// A waiter hands its queue's lock to sched_block(), which drops it only once
+// the task is BLOCKED, so a wakeup on another CPU can't slip in between.
+
+void wait_queue_init(wait_queue_t *wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Block the running task until wake_one/wake_all. As with any condition
+// variable, check the condition again after waking up.
+void wait_on(wait_queue_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    wait_on_locked(wq);
+    irq_restore(flags);
+}
+
+// wait_on() for a caller that checked its condition under wq->lock, so a
+// waker on another CPU can't slip in between. Interrupts off. The lock is
+// dropped once the task is asleep and not held on return.
+void wait_on_locked(wait_queue_t *wq) {
+    tcb_t *task = current_task;
+    task->wait_next = NULL;
+    if (wq->tail) wq->tail->wait_next = task;
+    else wq->head = task;
+    wq->tail = task;
+
+    sched_block(&wq->lock);
+}
+
+void wake_one(wait_queue_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    wake_one_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// wake_one() with wq->lock already held
+void wake_one_locked(wait_queue_t *wq) {
+    tcb_t *task = wq->head;
+    if (task) {
+        wq->head = task->wait_next;
+        if (wq->head == NULL) wq->tail = NULL;
+        task->wait_next = NULL;
+        sched_wake(task);
+    }
+}
+
+void wake_all(wait_queue_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+    tcb_t *task = wq->head;
+    wq->head = wq->tail = NULL;
+    while (task) {
+        tcb_t *next = task->wait_next;
+        task->wait_next = NULL;
+        sched_wake(task);
+        task = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+struct sleeper {
+    struct timer timer;
+    spinlock_t lock;
+    tcb_t *task;
+    bool done;
+};
+
+static void sleep_timeout(struct timer *timer) {
+    struct sleeper *sleeper = timer->data;
+    uint64_t flags = spin_lock_irqsave(&sleeper->lock);
+    sleeper->done = true;
+    sched_wake(sleeper->task);
+    spin_unlock_irqrestore(&sleeper->lock, flags);
+}
+
+// Sleep for at least us microseconds. With a one-shot timer that's what you
+// get, on the periodic PIT it's rounded up to the next tick.
+void sleep_us(uint64_t us) {
+    struct sleeper sleeper = { .lock = SPINLOCK_INIT, .task = current_task, .done = false };
+    timer_init(&sleeper.timer, sleep_timeout, &sleeper);
+
+    uint64_t flags = spin_lock_irqsave(&sleeper.lock);
+    timer_add_us(&sleeper.timer, us);
+    while (!sleeper.done) {
+        sched_block(&sleeper.lock);
+        spin_lock(&sleeper.lock);
+    }
+    spin_unlock(&sleeper.lock);
+
+    // The callback may still be on its way out on another CPU
+    timer_cancel(&sleeper.timer);
+    irq_restore(flags);
+}
+
+void sleep_ms(uint64_t ms) {
+    sleep_us(ms * 1000);
+}
+
+struct wait_timeout {
+    struct timer timer;
+    wait_queue_t *wq;
+    tcb_t *task;
+    bool timed_out;
+};
+
+// Time's up: if nobody woke the task yet, take it off the queue ourselves
+static void wait_timeout(struct timer *timer) {
+    struct wait_timeout *wait = timer->data;
+    wait_queue_t *wq = wait->wq;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+    tcb_t *prev = NULL;
+    tcb_t *task = wq->head;
+    while (task && task != wait->task) {
+        prev = task;
+        task = task->wait_next;
+    }
+    if (task == NULL) { // Already woken, it just hasn't run yet
+        spin_unlock_irqrestore(&wq->lock, flags);
+        return;
+    }
+
+    if (prev) prev->wait_next = task->wait_next;
+    else wq->head = task->wait_next;
+    if (wq->tail == task) wq->tail = prev;
+    task->wait_next = NULL;
+
+    wait->timed_out = true;
+    sched_wake(task);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// wait_on() that gives up after us microseconds. Returns 0 if woken, or
+// -ETIMEDOUT.
+int wait_on_timeout(wait_queue_t *wq, uint64_t us) {
+    struct wait_timeout wait = { .wq = wq, .task = current_task, .timed_out = false };
+    timer_init(&wait.timer, wait_timeout, &wait);
+
+    uint64_t flags = irq_save();
+    timer_add_us(&wait.timer, us);
+    wait_on(wq);
+    timer_cancel(&wait.timer);
+    irq_restore(flags);
+
+    return wait.timed_out ? -ETIMEDOUT : 0;
+}
@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <panic.h>
+#include <terminal.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <task.h>
+#include <wait.h>
+#include <workqueue.h>
+
+// Per-CPU work queues, each drained by a worker task pinned to its CPU.
+// Queueing takes the queue's lock with interrupts off, so it works from
+// interrupt handlers too. A worker takes everything queued in one go and
+// runs it with the lock dropped and interrupts on, so a burst of work costs
+// one wakeup.
+
+struct workqueue {
+    wait_queue_t wait;      // Its lock also covers the list
+    struct work *head;
+    struct work *tail;
+    tcb_t *worker;
+} __attribute__((aligned(64)));
+
+static struct workqueue queues[MAX_CPUS];
+
+static void worker_loop(void) {
+    struct workqueue *queue = &queues[this_cpu_id()]; // Pinned, so it stays ours
+
+    while (1) {
+        // 1. Sleep until there's something, then take all of it
+        uint64_t flags = spin_lock_irqsave(&queue->wait.lock);
+        while (queue->head == NULL) {
+            wait_on_locked(&queue->wait);
+            spin_lock(&queue->wait.lock);
+        }
+        struct work *list = queue->head;
+        queue->head = queue->tail = NULL;
+        spin_unlock_irqrestore(&queue->wait.lock, flags);
+
+        // 2. Run it. Clearing pending first lets fn queue its work again.
+        while (list) {
+            struct work *work = list;
+            list = work->next;
+            __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+            work->fn(work);
+        }
+    }
+}
+
+// A worker for every CPU that's up. Work queued before this waits for it.
+void init_workqueues(void) {
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        if (!cpus[cpu]->online) continue;
+        tcb_t *worker = create_task_pinned(worker_loop, cpu);
+        if (worker == NULL) panic("Could not create the work queue workers.");
+        sched_set_priority(worker, WORKER_PRIORITY);
+        queues[cpu].worker = worker;
+    }
+}
+
+void work_init(struct work *work, void (*fn)(struct work *), void *data) {
+    work->next = NULL;
+    work->pending = false;
+    work->fn = fn;
+    work->data = data;
+}
+
+// Queue work on a given CPU. Returns false if it was already queued (it
+// still runs just once).
+bool queue_work_on(uint32_t cpu, struct work *work) {
+    if (__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQ_REL)) return false;
+
+    struct workqueue *queue = &queues[cpu];
+    uint64_t flags = spin_lock_irqsave(&queue->wait.lock);
+    work->next = NULL;
+    if (queue->tail) queue->tail->next = work;
+    else queue->head = work;
+    queue->tail = work;
+    wake_one_locked(&queue->wait);
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+    return true;
+}
+
+// Queue work on this CPU
+bool queue_work(struct work *work) {
+    uint64_t flags = irq_save();
+    bool queued = queue_work_on(this_cpu_id(), work);
+    irq_restore(flags);
+    return queued;
+}
+
+bool work_pending(struct work *work) {
+    return __atomic_load_n(&work->pending, __ATOMIC_ACQUIRE);
+}
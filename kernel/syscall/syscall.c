@@ -1,4 +1,15 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <cpu.h>
+#include <gdt.h>
+#include <percpu.h>
+#include <terminal.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <task.h>
+#include <elf.h>
+#include <syscall.h>
 
 #define STAR_MSR  0xC0000081
 #define LSTAR_MSR 0xC0000082
@@ -6,50 +17,95 @@
 
 extern void syscall_entry(); // We'll write this in assembly
 
-static inline void wrmsr(uint32_t msr, uint64_t value) {
-    uint32_t low = value & 0xFFFFFFFF;
-    uint32_t high = value >> 32;
-    asm volatile (
-        "wrmsr"
-        :
-        : "c"(msr), "a"(low), "d"(high)
-        : "memory"
-    );
-}
-
-static inline uint64_t rdmsr(uint32_t msr) {
-    uint32_t low, high;
-    asm volatile (
-        "rdmsr"
-        : "=a"(low), "=d"(high)
-        : "c"(msr)
-        : "memory"
-    );
-    return ((uint64_t)high << 32) | low;
-}
+// syscall_entry.S has these hardcoded
+_Static_assert(offsetof(struct cpu, kernel_rsp) == 24, "syscall_entry.S: CPU_KERNEL_RSP");
+_Static_assert(offsetof(struct cpu, user_rsp) == 32, "syscall_entry.S: CPU_USER_RSP");
 
 void init_syscall(void) {
     // 1. Entry Point: Where the CPU jumps when 'syscall' is executed
     wrmsr(LSTAR_MSR, (uint64_t)syscall_entry);
 
     // 2. STAR MSR: Defines the segments for both entry and exit.
-    // [48:63] User Segment Base: Points to User Data (0x18). 
-    //         sysret will use this + 8 for CS and + 0 for SS.
-    // [32:47] Kernel Segment Base: Points to Kernel Code (0x08).
+    // [48:63] User Segment Base: sysret uses this + 16 for CS and + 8 for
+    //         SS, both with RPL 3 (see gdt.h).
+    // [32:47] Kernel Segment Base: Points to Kernel Code.
     //         syscall will use this + 0 for CS and + 8 for SS.
-    
-    // We use (0x18 | 3) for the user base to set the Request Privilege Level to Ring 3.
-    uint64_t star = ((uint64_t)(0x18 | 3) << 48) | ((uint64_t)0x08 << 32);
+    uint64_t star = ((uint64_t)(GDT_USER_BASE | 3) << 48) | ((uint64_t)GDT_KERNEL_CS << 32);
     wrmsr(STAR_MSR, star);
 
     // 3. SFMASK: System Call Flag Mask
     // This tells the CPU which bits in RFLAGS to CLEAR when entering the kernel.
-    // 0x200 = Interrupt Flag. This ensures interrupts are DISABLED 
-    // automatically when the syscall starts so we don't crash.
-    wrmsr(SFMASK_MSR, 0x200);
+    // Interrupts stay off until syscall_entry is on the kernel stack, and
+    // the program's direction, trap and alignment flags don't follow us in.
+    wrmsr(SFMASK_MSR, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF | RFLAGS_AC);
 
     // 4. EFER: Extended Feature Enable Register
     // Bit 0 is 'SCE' (System Call Enable). Without this, 'syscall' is an invalid instruction.
-    uint64_t efer = rdmsr(0xC0000080);
-    wrmsr(0xC0000080, efer | 1);
-}
\ No newline at end of file
+    uint64_t efer = rdmsr(MSR_EFER);
+    wrmsr(MSR_EFER, efer | EFER_SCE);
+
+    // 5. The GS base programs run with, swapped in and out by swapgs
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_SYSCALLS    100000
+#define BENCH_SYSCALL_RIP 0x400000
+
+#define STR(x)  #x
+#define XSTR(x) STR(x)
+
+// Ring 3 code for bench_syscall(), copied into a page of its own: times
+// BENCH_SYSCALLS gettid() calls and exits with the cycles each took. It
+// never touches its stack.
+extern uint8_t bench_syscall_user[], bench_syscall_user_end[];
+
+__asm__(
+    "bench_syscall_user:\n"
+    "    rdtsc\n"
+    "    shl $32, %rdx\n"
+    "    or %rdx, %rax\n"
+    "    mov %rax, %r12\n"
+    "    mov $" XSTR(BENCH_SYSCALLS) ", %ebx\n"
+    "1:  mov $" XSTR(SYS_GETTID) ", %eax\n"
+    "    syscall\n"
+    "    dec %ebx\n"
+    "    jnz 1b\n"
+    "    rdtsc\n"
+    "    shl $32, %rdx\n"
+    "    or %rdx, %rax\n"
+    "    sub %r12, %rax\n"
+    "    xor %edx, %edx\n"
+    "    mov $" XSTR(BENCH_SYSCALLS) ", %ecx\n"
+    "    div %rcx\n"
+    "    mov %rax, %rdi\n"
+    "    mov $" XSTR(SYS_EXIT) ", %eax\n"
+    "    syscall\n"
+    "bench_syscall_user_end:\n"
+);
+
+// The whole way from ring 3 into the kernel and back, with the cheapest
+// syscall there is
+void bench_syscall(void) {
+    struct vm_space *space = vmm_new_space();
+    if (space == NULL) return;
+    uint64_t code = BENCH_SYSCALL_RIP;
+    int err = vma_add(space, code, code + PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, NULL, 0, 0);
+    if (err == 0) err = vma_populate(space, code, code + PAGE_SIZE);
+    if (err < 0) {
+        vmm_free_space(space);
+        return;
+    }
+    memcpy(PHYS_TO_VIRT(vmm_translate(space->pml4, code)), bench_syscall_user,
+           bench_syscall_user_end - bench_syscall_user);
+
+    tcb_t *task = create_user_task(space, code, USER_STACK_TOP);
+    if (task == NULL) {
+        vmm_free_space(space);
+        return;
+    }
+    int cycles;
+    if (task_join(task->tid, &cycles) < 0) return;
+    printf("bench: syscall round trip (SYSCALL/SYSRET from ring 3): %d cycles\n", cycles);
+}
+#endif
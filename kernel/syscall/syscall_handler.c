@@ -1,13 +1,59 @@
 #include <stdint.h>
 #include <terminal.h>
+#include <errno.h>
+#include <syscall.h>
+#include <file.h>
+#include <vmm.h>
+#include <task.h>
+#include <wait.h>
+#include <clock.h>
 
-void syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2) {
+// Longest sleep, in ns: about 9 years, short enough that the deadline in
+// TSC ticks can't wrap, long enough to be forever for anyone asking more
+#define SLEEP_MAX_NS (1ull << 58)
+
+uint64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                         uint64_t arg4, uint64_t arg5, uint64_t arg6) {
     switch (syscall_num) {
-        case 1:
+        case SYS_HELLOWORLD:
             printf("Hello world from syscall!");
-            break;
+            return 0;
+        case SYS_OPEN:
+            return sys_open((const char *)arg1, arg2);
+        case SYS_READ:
+            return sys_read(arg1, (void *)arg2, arg3);
+        case SYS_PREAD:
+            return sys_pread(arg1, (void *)arg2, arg3, arg4);
+        case SYS_LSEEK:
+            return sys_lseek(arg1, (int64_t)arg2, arg3);
+        case SYS_CLOSE:
+            return sys_close(arg1);
+        case SYS_MMAP:
+            return sys_mmap(arg1, arg2, arg3, arg4, arg5, arg6);
+        case SYS_MUNMAP:
+            return sys_munmap(arg1, arg2);
+        case SYS_YIELD:
+            yield();
+            return 0;
+        case SYS_NANOSLEEP:
+            sleep_us(((arg1 < SLEEP_MAX_NS ? arg1 : SLEEP_MAX_NS) + 999) / 1000);
+            return 0;
+        case SYS_CLOCK_GETTIME:
+            return sys_clock_gettime(arg1, (struct timespec *)arg2);
+        case SYS_EXIT:
+            task_exit((int)arg1);
+        case SYS_GETTID:
+            return current_task->tid;
+        case SYS_JOIN:
+            return sys_join(arg1, (int *)arg2);
+        case SYS_TASK_STATS:
+            return sys_task_stats((struct task_stats *)arg1, arg2);
+        case SYS_SCHED_HIST:
+            return sys_sched_hist(arg1, (uint64_t *)arg2);
+        case SYS_BRK:
+            return sys_brk(arg1);
         default:
             printf("Unknown syscall: %llu\n", syscall_num);
-            break;
+            return -ENOSYS;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <cpu.h>
+#include <errno.h>
+#include <panic.h>
+#include <terminal.h>
+#include <pit.h>
+#include <clock.h>
+#include <uaccess.h>
+
+// The TSC is the kernel's time source: one rdtsc and a multiply, no port
+// I/O. It's calibrated against the PIT at boot. On CPUs with an invariant
+// TSC it ticks at a constant rate through frequency and power state
+// changes; elsewhere it's the best we have, and we say so.
+
+#define CALIBRATE_US     10000
+#define CALIBRATE_ROUNDS 5
+
+extern volatile struct limine_date_at_boot_request date_req;
+
+uint64_t tsc_hz = 0;
+
+static uint64_t tsc_base = 0;     // TSC at init_clock(), ktime_ns() counts from here
+static uint64_t ns_mult = 0;      // Nanoseconds per TSC tick, 32.32 fixed point
+static int64_t boot_epoch = 0;    // Wall clock seconds at tsc_base, 0 if unknown
+static bool invariant = false;
+
+bool clock_tsc_invariant(void) {
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a < 0x80000007) return false;
+    cpuid(0x80000007, 0, &a, &b, &c, &d);
+    return d & (1 << 8);
+}
+
+// One PIT-timed window, in TSC ticks
+static uint64_t calibrate_once(void) {
+    pit_gate_start(CALIBRATE_US);
+    uint64_t start = rdtsc();
+    while (!pit_gate_done());
+    return rdtsc() - start;
+}
+
+void init_clock(void) {
+    // 1. Median of a few windows, so an SMI or a slow port read in one of
+    //    them doesn't skew the result
+    uint64_t samples[CALIBRATE_ROUNDS];
+    for (int i = 0; i < CALIBRATE_ROUNDS; i++) {
+        uint64_t cycles = calibrate_once();
+        int j = i;
+        while (j > 0 && samples[j - 1] > cycles) {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+        samples[j] = cycles;
+    }
+    tsc_hz = samples[CALIBRATE_ROUNDS / 2] * (1000000 / CALIBRATE_US);
+    if (tsc_hz == 0) panic("Could not calibrate the TSC.");
+
+    // 2. Scale factor for ktime_ns()
+    ns_mult = (NSEC_PER_SEC << 32) / tsc_hz;
+    tsc_base = rdtsc();
+
+    // 3. Wall clock, if the bootloader read the RTC for us
+    if (date_req.response) boot_epoch = date_req.response->timestamp;
+
+    invariant = clock_tsc_invariant();
+    printf("TSC: %U MHz%s\n", tsc_hz / 1000000, invariant ? ", invariant" : ", NOT invariant (may drift)");
+}
+
+uint64_t tsc_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> 32);
+}
+
+// Nanoseconds since boot. Monotonic, about 20 cycles on top of the rdtsc.
+uint64_t ktime_ns(void) {
+    return tsc_to_ns(rdtsc() - tsc_base);
+}
+
+int64_t sys_clock_gettime(uint64_t clock, struct timespec *ts) {
+    uint64_t now = ktime_ns();
+    struct timespec t;
+    switch (clock) {
+        case CLOCK_MONOTONIC:
+            t.tv_sec = now / NSEC_PER_SEC;
+            break;
+        case CLOCK_REALTIME:
+            t.tv_sec = boot_epoch + now / NSEC_PER_SEC;
+            break;
+        default:
+            return -EINVAL;
+    }
+    t.tv_nsec = now % NSEC_PER_SEC;
+    return copy_to_user(ts, &t, sizeof(t));
+}
+
+#ifdef CONFIG_BENCH
+void bench_clock(void) {
+    volatile uint64_t sink;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) sink = ktime_ns();
+    uint64_t cycles = (rdtsc() - start) / 100000;
+    (void)sink;
+
+    printf("bench: ktime_ns %U cycles (%U ns)\n", cycles, tsc_to_ns(cycles));
+}
+#endif
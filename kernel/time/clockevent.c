@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <io.h>
+#include <idt.h>
+#include <terminal.h>
+#include <apic.h>
+#include <pit.h>
+#include <clock.h>
+#include <task.h>
+#include <timer.h>
+#include <percpu.h>
+#include <softirq.h>
+#include <clockevent.h>
+
+// The timer interrupt source. Whenever we can, it's the local APIC timer in
+// one-shot mode, armed for the next thing the scheduler actually has to do
+// (a slice running out, a sleeper waking up), so an idle CPU or one running
+// a single task takes no interrupts at all. The PIT's fixed tick is only
+// the fallback for CPUs without an APIC.
+//
+// Every CPU has its own LAPIC timer. The BSP picks the mode and calibrates,
+// the APs just set theirs up the same way.
+
+#define CALIBRATE_US 10000
+
+enum clockevent_mode {
+    CLOCKEVENT_PIT,      // Periodic at HZ, programming is a no-op
+    CLOCKEVENT_ONESHOT,  // LAPIC count-down, converted from TSC deadlines
+    CLOCKEVENT_DEADLINE, // LAPIC TSC-deadline: the deadline goes in as is
+};
+
+static enum clockevent_mode mode = CLOCKEVENT_PIT;
+static uint64_t armed[MAX_CPUS] = {       // Deadline each CPU's hardware has
+    [0 ... MAX_CPUS - 1] = CLOCKEVENT_NONE
+};
+static uint64_t lapic_per_tsc = 0;        // LAPIC counts per TSC tick, 32.32 fixed point
+
+static bool has_tsc_deadline(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    return c & (1 << 24);
+}
+
+// How fast the LAPIC timer counts (after the divide by 16) against the TSC
+static void calibrate_lapic(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | TIMER_VECTOR);
+
+    pit_gate_start(CALIBRATE_US);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64_t start = rdtsc();
+    while (!pit_gate_done());
+    uint64_t cycles = rdtsc() - start;
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_per_tsc = ((uint64_t)counted << 32) / cycles;
+}
+
+void init_clockevent(void) {
+    if (!lapic_present()) {
+        mode = CLOCKEVENT_PIT;
+        init_pit(HZ);
+        printf("Timer: PIT at %u Hz\n", HZ);
+        return;
+    }
+
+    // 1. The PIT's IRQ0 has nothing left to do
+    outb(0x21, inb(0x21) | 0x01);
+
+    // 2. TSC-deadline needs no calibration, the count-down timer does
+    if (has_tsc_deadline()) {
+        mode = CLOCKEVENT_DEADLINE;
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_DEADLINE | TIMER_VECTOR);
+        asm volatile("mfence" : : : "memory"); // LVT write before the first wrmsr
+        printf("Timer: LAPIC TSC-deadline, tickless\n");
+    } else {
+        mode = CLOCKEVENT_ONESHOT;
+        calibrate_lapic();
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+        printf("Timer: LAPIC one-shot at %U kHz, tickless\n", (lapic_per_tsc * (tsc_hz / 1000)) >> 32);
+    }
+
+    // 3. Nothing is armed yet, have the scheduler look at things right away
+    clockevent_program(rdtsc());
+}
+
+// An AP's LAPIC timer, in whatever mode the BSP settled on
+void init_clockevent_ap(void) {
+    if (mode == CLOCKEVENT_PIT) return; // The PIT only interrupts the BSP
+
+    if (mode == CLOCKEVENT_DEADLINE) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_DEADLINE | TIMER_VECTOR);
+        asm volatile("mfence" : : : "memory");
+    } else {
+        lapic_write(LAPIC_TIMER_DIV, 0x3);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+    }
+    clockevent_program(rdtsc());
+}
+
+bool clockevent_oneshot(void) {
+    return mode != CLOCKEVENT_PIT;
+}
+
+// Make sure an interrupt comes no later than deadline (a TSC value). An
+// earlier one is left alone: it fires, finds nothing due, and re-arms. That
+// keeps the common case, a switch pushing the deadline out, free of MMIO.
+// Call with interrupts off.
+void clockevent_program(uint64_t deadline) {
+    uint32_t cpu = this_cpu_id();
+    if (mode == CLOCKEVENT_PIT || deadline >= armed[cpu]) return;
+    armed[cpu] = deadline;
+
+    if (mode == CLOCKEVENT_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    // Count-down: clamp so the fixed point multiply can't overflow. A far
+    // deadline just costs an early interrupt that re-arms.
+    uint64_t now = rdtsc();
+    uint64_t delta = deadline > now ? deadline - now : 1;
+    if (delta > 0x7FFFFFFF) delta = 0x7FFFFFFF;
+    uint64_t count = (delta * lapic_per_tsc) >> 32;
+    lapic_write(LAPIC_TIMER_INIT, count ? count : 1);
+}
+
+// Both the PIT (vector 32) and the LAPIC timer end up here. The timers
+// themselves run in the softirq, with interrupts back on.
+void timer_interrupt(void) {
+    uint64_t outer = irq_enter();
+    if (mode == CLOCKEVENT_PIT) {
+        outb(0x20, 0x20);
+    } else {
+        armed[this_cpu_id()] = CLOCKEVENT_NONE;
+        lapic_eoi();
+    }
+    raise_softirq(SOFTIRQ_TIMER);
+    irq_exit(outer);
+    sched_tick();
+}
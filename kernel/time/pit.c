@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <io.h>
+#include <pit.h>
+
+// The legacy 8254. Channel 0 is the periodic tick when there is no local
+// APIC timer, channel 2 is a one-shot reference for calibrating the others.
+
+void init_pit(uint32_t frequency) {
+    uint32_t divisor = PIT_FREQ / frequency;
+
+    // 0x36 sets the PIT to Square Wave Mode and expects 2 bytes for the divisor
+    outb(0x43, 0x36);
+
+    // Send the frequency divisor (Split into low/high bytes)
+    outb(0x40, (uint8_t)(divisor & 0xFF));
+    outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
+}
+
+// Start counting down us microseconds (at most ~54 ms) on channel 2. Its
+// output is wired to bit 5 of port 0x61, so it can be polled without an IRQ.
+void pit_gate_start(uint32_t us) {
+    uint64_t count = (uint64_t)PIT_FREQ * us / 1000000;
+    if (count > 0xFFFF) count = 0xFFFF;
+
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // Gate on, speaker off
+    outb(0x43, 0xB0);                       // Channel 2, lo/hi byte, mode 0
+    outb(0x42, (uint8_t)(count & 0xFF));
+    outb(0x42, (uint8_t)((count >> 8) & 0xFF));
+}
+
+bool pit_gate_done(void) {
+    return inb(0x61) & 0x20;
+}
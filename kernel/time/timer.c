@@ -0,0 +1,300 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <panic.h>
+#include <terminal.h>
+#include <clock.h>
+#include <clockevent.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <softirq.h>
+#include <timer.h>
+
+// Hierarchical timing wheel. Level 0 has one slot per wheel tick (about
+// 15-30 us, a power of two of TSC ticks), each level above is 64 times
+// coarser. A timer goes in the slot of the lowest level that reaches its
+// deadline, and when a lower level wraps, the next slot of the level above
+// is pulled down ("cascaded"). Adding and cancelling are O(1), and so is
+// finding the next deadline: a bitmap per level tells which slots are
+// non-empty. After a tickless stretch the wheel jumps straight to the next
+// slot with work in it instead of walking every tick in between.
+//
+// Every CPU has its own wheel, and a timer fires on the CPU that added it.
+// Cancelling may happen from anywhere, so each wheel has a lock, and
+// timer_cancel() waits out a callback that's already running elsewhere.
+// Callbacks run from the timer softirq, with interrupts on.
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_RANGE  (1ull << (WHEEL_LEVELS * WHEEL_BITS))
+
+// Roughly how many wheel ticks per second we aim for
+#define WHEEL_TARGET_HZ 65536
+
+struct wheel {
+    spinlock_t lock;
+    uint64_t clk;                                   // Next tick to process
+    uint64_t bitmap[WHEEL_LEVELS];                  // Bit n set = slot n not empty
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+    struct timer *running;                          // Callback in progress
+};
+
+static struct wheel wheels[MAX_CPUS];
+
+static uint32_t tick_shift;                         // TSC ticks per wheel tick, log2
+
+static void link_timer(struct timer **head, struct timer *timer) {
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void unlink_timer(struct wheel *wheel, struct timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    if (wheel->slots[timer->level][timer->index] == NULL) {
+        wheel->bitmap[timer->level] &= ~(1ull << timer->index);
+    }
+}
+
+static void wheel_insert(struct wheel *wheel, struct timer *timer) {
+    // 1. Overdue goes in the very next slot, too far goes as far as we reach
+    //    (and gets cascaded down again until it's close enough)
+    uint64_t expires = timer->expires;
+    if (expires < wheel->clk) expires = wheel->clk;
+    uint64_t delta = expires - wheel->clk;
+    if (delta >= WHEEL_RANGE) {
+        delta = WHEEL_RANGE - 1;
+        expires = wheel->clk + delta;
+    }
+
+    // 2. Lowest level whose span covers it
+    int level = 0;
+    while (delta >= (1ull << ((level + 1) * WHEEL_BITS))) level++;
+
+    timer->level = level;
+    timer->index = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    link_timer(&wheel->slots[level][timer->index], timer);
+    wheel->bitmap[level] |= 1ull << timer->index;
+}
+
+// Pull one slot down into the levels below
+static void cascade(struct wheel *wheel, int level, int index) {
+    struct timer *list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->bitmap[level] &= ~(1ull << index);
+
+    while (list) {
+        struct timer *timer = list;
+        list = timer->next;
+        wheel_insert(wheel, timer);
+    }
+}
+
+// First tick at or after clk where a level 0 slot is due or a non-empty slot
+// above it cascades. UINT64_MAX if the wheel is empty.
+static uint64_t wheel_next_tick(struct wheel *wheel) {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t bits = wheel->bitmap[level];
+        if (bits == 0) continue;
+
+        // Slot n of this rotation comes up at base + n * span. Slots already
+        // behind clk are for the next rotation.
+        int shift = level * WHEEL_BITS;
+        uint64_t span = 1ull << shift;
+        uint64_t base = wheel->clk & ~((span << WHEEL_BITS) - 1);
+        uint64_t pos = (wheel->clk - base + span - 1) >> shift;
+        uint64_t ahead = pos < WHEEL_SIZE ? bits & (~0ull << pos) : 0;
+
+        uint64_t tick = ahead ? base + (bsf(ahead) << shift)
+                              : base + (span << WHEEL_BITS) + (bsf(bits) << shift);
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+static void timer_softirq(void) {
+    run_timers(rdtsc());
+}
+
+void init_timers(void) {
+    if (tsc_hz == 0) panic("Timers need a calibrated TSC.");
+
+    tick_shift = 0;
+    while ((tsc_hz >> (tick_shift + 1)) >= WHEEL_TARGET_HZ) tick_shift++;
+
+    uint64_t clk = rdtsc() >> tick_shift;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&wheels[i].lock);
+        wheels[i].clk = clk;
+    }
+    open_softirq(SOFTIRQ_TIMER, timer_softirq);
+}
+
+void timer_init(struct timer *timer, void (*fn)(struct timer *), void *data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->pending = false;
+    timer->cpu = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+// Lock the wheel timer is on (or was last on), which can change under us
+static struct wheel *lock_timer_wheel(struct timer *timer) {
+    while (1) {
+        uint32_t cpu = __atomic_load_n(&timer->cpu, __ATOMIC_RELAXED);
+        struct wheel *wheel = &wheels[cpu];
+        spin_lock(&wheel->lock);
+        if (timer->cpu == cpu) return wheel;
+        spin_unlock(&wheel->lock);
+    }
+}
+
+// Run the timer once the TSC reaches deadline (never before), on this CPU.
+// Re-adding a pending timer moves it.
+void timer_add(struct timer *timer, uint64_t deadline) {
+    uint64_t flags = irq_save();
+
+    // 1. Off whichever wheel it's on now
+    struct wheel *old = lock_timer_wheel(timer);
+    if (timer->pending) {
+        unlink_timer(old, timer);
+        timer->pending = false;
+    }
+    spin_unlock(&old->lock);
+
+    // 2. Onto ours
+    struct wheel *wheel = &wheels[this_cpu_id()];
+    spin_lock(&wheel->lock);
+    timer->expires = (deadline + (1ull << tick_shift) - 1) >> tick_shift;
+    timer->pending = true;
+    timer->cpu = this_cpu_id();
+    wheel_insert(wheel, timer);
+    spin_unlock(&wheel->lock);
+
+    clockevent_program(timer->expires << tick_shift);
+    irq_restore(flags);
+}
+
+void timer_add_us(struct timer *timer, uint64_t us) {
+    timer_add(timer, rdtsc() + tsc_from_us(us));
+}
+
+// Returns whether it was still pending, i.e. fn has not run and won't.
+// Either way, fn is not running anywhere once this returns, so don't call
+// it from the timer's own callback, or from a hard interrupt handler.
+bool timer_cancel(struct timer *timer) {
+    uint64_t flags = irq_save();
+    struct wheel *wheel = lock_timer_wheel(timer);
+    bool was_pending = timer->pending;
+    if (was_pending) {
+        unlink_timer(wheel, timer);
+        timer->pending = false;
+    }
+    while (wheel->running == timer) {
+        spin_unlock(&wheel->lock);
+        cpu_relax();
+        spin_lock(&wheel->lock);
+    }
+    spin_unlock(&wheel->lock);
+    irq_restore(flags);
+    return was_pending;
+}
+
+bool timer_pending(struct timer *timer) {
+    return timer->pending;
+}
+
+// Run everything due by now (a TSC value) on this CPU's wheel. Callbacks
+// run without the wheel lock and with interrupts as the caller had them, so
+// they can add and cancel timers freely.
+void run_timers(uint64_t now) {
+    uint64_t flags = irq_save();
+    struct wheel *wheel = &wheels[this_cpu_id()];
+    now >>= tick_shift;
+    spin_lock(&wheel->lock);
+
+    while (wheel->clk <= now) {
+        // 1. Skip ahead to where there's work, if that's still in the past
+        uint64_t next = wheel_next_tick(wheel);
+        if (next > now) {
+            wheel->clk = now + 1;
+            break;
+        }
+        wheel->clk = next;
+
+        // 2. Every level that wraps here pulls down its next slot
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->clk & ((1ull << (level * WHEEL_BITS)) - 1)) break;
+            cascade(wheel, level, (wheel->clk >> (level * WHEEL_BITS)) & WHEEL_MASK);
+        }
+
+        // 3. Take the due slot off the wheel before running anything
+        int index = wheel->clk & WHEEL_MASK;
+        struct timer *list = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        wheel->bitmap[0] &= ~(1ull << index);
+        if (list) list->pprev = &list;
+        wheel->clk++;
+
+        while (list) {
+            struct timer *timer = list;
+            unlink_timer(wheel, timer);
+            timer->pending = false;
+            wheel->running = timer;
+            spin_unlock_irqrestore(&wheel->lock, flags);
+            timer->fn(timer);
+            flags = spin_lock_irqsave(&wheel->lock);
+            wheel->running = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&wheel->lock, flags);
+}
+
+// When the timer interrupt is next needed for this CPU's wheel (a TSC
+// value). Lock-free: a timer added concurrently programs the timer itself.
+uint64_t timer_next_deadline(void) {
+    uint64_t tick = wheel_next_tick(&wheels[this_cpu_id()]);
+    return tick == UINT64_MAX ? CLOCKEVENT_NONE : tick << tick_shift;
+}
+
+#ifdef CONFIG_BENCH
+#define BENCH_TIMERS 10000
+
+static void bench_nop(struct timer *timer) {
+    (void)timer;
+}
+
+void bench_timers(void) {
+    static struct timer timers[BENCH_TIMERS];
+    uint64_t base = rdtsc() + tsc_hz * 60; // Far enough out that none fire
+
+    // Add and cancel with n timers already pending: the cost should not move
+    for (uint32_t pending = 10; pending <= BENCH_TIMERS; pending *= 10) {
+        for (uint32_t i = 0; i < pending; i++) {
+            timer_init(&timers[i], bench_nop, NULL);
+            timer_add(&timers[i], base + i * 997 * (tsc_hz / 1000000));
+        }
+
+        struct timer probe;
+        timer_init(&probe, bench_nop, NULL);
+        uint64_t start = rdtsc();
+        for (int i = 0; i < 1000; i++) {
+            timer_add(&probe, base + i * 1009 * (tsc_hz / 1000000));
+            timer_cancel(&probe);
+        }
+        uint64_t cycles = (rdtsc() - start) / 1000;
+
+        for (uint32_t i = 0; i < pending; i++) timer_cancel(&timers[i]);
+        printf("bench: timer add+cancel with %u pending: %U cycles\n", pending, cycles);
+    }
+}
+#endif